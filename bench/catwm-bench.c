@@ -0,0 +1,577 @@
+/*
+ *  catwm-bench: replays scripted workloads against catwm-xcb running on Xvfb
+ *
+ *  See catwm-xcb.c for copyright and licence.
+ *
+ *  The driver starts Xvfb and catwm-xcb, then connects as an ordinary client.
+ *  Each workload is timed on our side, and the requests the WM sent for it
+ *  come from its SIGUSR1 statistics, less what synchronizing with it costs.
+ *  The shortcuts are the default ones from config.h (MOD is Alt), pressed
+ *  through XTEST.
+ *
+ *  Usage: catwm-bench [-d display] [-n windows] [-k switches] [-r rounds] [-i idle seconds] [path/to/catwm-xcb]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <X11/keysym.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xcb/xcb_keysyms.h>
+
+// WM statistics we read back
+typedef struct wmstats wmstats;
+struct wmstats
+{
+    unsigned long events;
+    unsigned long batches;
+    unsigned long requests;
+    unsigned long wakeups;
+    unsigned long idle_wakeups;
+
+    // sync_wm() calls made before these were read
+    unsigned long syncs;
+};
+
+static xcb_connection_t *connection;
+static xcb_screen_t *screen;
+static xcb_key_symbols_t *keysyms;
+static pid_t xvfb_pid;
+static pid_t wm_pid;
+static char logpath[] = "/tmp/catwm-bench.XXXXXX";
+static char display[16] = ":99";
+
+static xcb_window_t *windows;
+static uint64_t *sent;
+static uint64_t *lat;
+static int nwindows = 200;
+static int nswitches = 200;
+static int nrounds = 10;
+static int idle = 2;
+
+// Never mapped window the WM doesn't manage, and what one sync through it
+// costs: the WM's work, and our time waiting for it
+static xcb_window_t sentinel;
+static unsigned long nsyncs;
+static struct
+{
+    double events, requests, wakeups, idle_wakeups;
+    uint64_t ns;
+} sync_cost;
+
+static void cleanup()
+{
+    if(wm_pid > 0)
+    {
+        kill(wm_pid, SIGTERM);
+        waitpid(wm_pid, NULL, 0);
+    }
+    if(xvfb_pid > 0)
+    {
+        kill(xvfb_pid, SIGTERM);
+        waitpid(xvfb_pid, NULL, 0);
+    }
+    unlink(logpath);
+}
+
+static void die(const char *format, ...)
+{
+    va_list vargs;
+
+    va_start(vargs, format);
+    fprintf(stderr, "catwm-bench: ");
+    vfprintf(stderr, format, vargs);
+    fprintf(stderr, "\n");
+    va_end(vargs);
+
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t timestamp()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static pid_t launch(char **argv, int out)
+{
+    pid_t pid;
+
+    if((pid = fork()) == 0)
+    {
+        if(out >= 0)
+            dup2(out, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if(pid < 0)
+        die("cannot fork");
+
+    return pid;
+}
+
+static void start_xvfb()
+{
+    char *argv[] = {"Xvfb", display, "-screen", "0", "1920x1080x24", "-nolisten", "tcp", "-noreset", NULL};
+    int i, null = open("/dev/null", O_WRONLY);
+
+    xvfb_pid = launch(argv, null);
+    close(null);
+
+    // Wait for the server to accept connections
+    for(i=0; i<200; ++i)
+    {
+        connection = xcb_connect(display, NULL);
+        if(!xcb_connection_has_error(connection))
+            break;
+
+        xcb_disconnect(connection);
+        connection = NULL;
+        usleep(25000);
+    }
+
+    if(!connection)
+        die("Xvfb did not come up on %s", display);
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+
+    if(!(keysyms = xcb_key_symbols_alloc(connection)))
+        die("couldn't allocate keysyms !");
+}
+
+static void start_wm(char *path)
+{
+    char *argv[] = {path, NULL};
+    xcb_get_window_attributes_reply_t *attr;
+    int i, log;
+
+    if((log = mkstemp(logpath)) < 0)
+        die("cannot create %s", logpath);
+
+    setenv("DISPLAY", display, 1);
+    wm_pid = launch(argv, log);
+    close(log);
+
+    // The WM is up once it redirects the root window
+    for(i=0; i<200; ++i)
+    {
+        attr = xcb_get_window_attributes_reply(connection, xcb_get_window_attributes(connection, screen->root), NULL);
+        if(attr && attr->all_event_masks & XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT)
+        {
+            free(attr);
+            return;
+        }
+
+        free(attr);
+        usleep(25000);
+    }
+
+    die("%s did not manage the display", path);
+}
+
+static xcb_window_t create_window()
+{
+    xcb_window_t w = xcb_generate_id(connection);
+    uint32_t values[] = {screen->white_pixel, XCB_EVENT_MASK_STRUCTURE_NOTIFY};
+
+    xcb_create_window(connection, XCB_COPY_FROM_PARENT, w, screen->root, 0, 0, 100, 100, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, values);
+    return w;
+}
+
+// Wait for a MapNotify on each of the n windows and record when it came
+static void wait_mapped(xcb_window_t *w, int n, uint64_t *when)
+{
+    xcb_generic_event_t *ge;
+    xcb_map_notify_event_t *e;
+    int i, hint = 0, left = n;
+
+    xcb_flush(connection);
+
+    while(left && (ge = xcb_wait_for_event(connection)))
+    {
+        if((ge->response_type & ~0x80) == XCB_MAP_NOTIFY)
+        {
+            e = (xcb_map_notify_event_t*)ge;
+
+            // Windows are usually mapped in order
+            for(i=0; i<n; ++i)
+                if(w[(hint + i) % n] == e->window)
+                {
+                    hint = (hint + i) % n;
+                    if(when)
+                        when[hint] = timestamp();
+                    --left;
+                    break;
+                }
+        }
+
+        free(ge);
+    }
+
+    if(left)
+        die("lost connection to the X server");
+}
+
+// The WM handles events in order: once it has passed on a ConfigureRequest
+// of the sentinel, it is done with everything we sent before. The sentinel
+// is never mapped, so the WM forwards the request and lays nothing out: a
+// sync costs the same whatever the workload left on screen.
+static void sync_wm()
+{
+    xcb_generic_event_t *ge;
+    xcb_configure_notify_event_t *e;
+    uint32_t width = 1 + nsyncs % 2;
+    int done = 0;
+
+    // Another width each time, for the server to report a change
+    xcb_configure_window(connection, sentinel, XCB_CONFIG_WINDOW_WIDTH, &width);
+    xcb_flush(connection);
+
+    while(!done && (ge = xcb_wait_for_event(connection)))
+    {
+        e = (xcb_configure_notify_event_t*)ge;
+        done = ge->response_type == XCB_CONFIGURE_NOTIFY && e->window == sentinel;
+        free(ge);
+    }
+
+    if(!done)
+        die("lost connection to the X server");
+
+    ++nsyncs;
+}
+
+// Wait for the WM to be done with a workload started at t, and how long it
+// took without the sync itself
+static uint64_t finish(uint64_t t)
+{
+    uint64_t dt;
+
+    sync_wm();
+    dt = timestamp() - t;
+    return dt > sync_cost.ns ? dt - sync_cost.ns : 0;
+}
+
+// Ask the WM for its counters, once it is done with what we sent, and read
+// its next dump from the log
+static void read_stats(wmstats *st)
+{
+    static int ndumps;
+    char line[512];
+    FILE *f;
+    int i, n = 0;
+
+    sync_wm();
+    st->syncs = nsyncs;
+    kill(wm_pid, SIGUSR1);
+
+    // The signal wakes the WM up by itself, the dump follows
+    for(i=0; i<100 && n <= ndumps; ++i)
+    {
+        if(i)
+            usleep(10000);
+
+        if(!(f = fopen(logpath, "r")))
+            die("cannot read %s", logpath);
+
+        for(n = 0; fgets(line, sizeof(line), f); )
+            if(sscanf(line, "catwm-xcb: %lu events, %lu batches, %lu requests", &st->events, &st->batches, &st->requests) == 3)
+                ++n;
+            else
+                sscanf(line, "catwm-xcb: %lu wakeups (%lu idle)", &st->wakeups, &st->idle_wakeups);
+
+        fclose(f);
+    }
+
+    if(n <= ndumps)
+        die("no statistics from the WM in %s", logpath);
+
+    ndumps = n;
+}
+
+// Take the syncs made in between out of the counters read after
+static void exclude_syncs(wmstats *before, wmstats *after)
+{
+    unsigned long n = after->syncs - before->syncs;
+
+    after->events -= (unsigned long)(n*sync_cost.events + 0.5);
+    after->requests -= (unsigned long)(n*sync_cost.requests + 0.5);
+    after->wakeups -= (unsigned long)(n*sync_cost.wakeups + 0.5);
+    after->idle_wakeups -= (unsigned long)(n*sync_cost.idle_wakeups + 0.5);
+}
+
+// Measure what a sync costs: a run of them and nothing else
+static void calibrate()
+{
+    wmstats before, after;
+    unsigned long n;
+    uint64_t t;
+    int i;
+
+    sentinel = create_window();
+
+    read_stats(&before);
+    t = timestamp();
+    for(i=0; i<50; ++i)
+        sync_wm();
+    t = timestamp() - t;
+    read_stats(&after);
+
+    n = after.syncs - before.syncs;
+    sync_cost.events = (double)(after.events - before.events)/n;
+    sync_cost.requests = (double)(after.requests - before.requests)/n;
+    sync_cost.wakeups = (double)(after.wakeups - before.wakeups)/n;
+    sync_cost.idle_wakeups = (double)(after.idle_wakeups - before.idle_wakeups)/n;
+    sync_cost.ns = t/50;
+}
+
+static xcb_keycode_t keycode(xcb_keysym_t sym)
+{
+    xcb_keycode_t *codes, code;
+
+    if(!(codes = xcb_key_symbols_get_keycode(keysyms, sym)))
+        die("no keycode for keysym 0x%x", sym);
+
+    code = codes[0];
+    free(codes);
+    return code;
+}
+
+static void press(xcb_keycode_t code, int press)
+{
+    xcb_test_fake_input(connection, press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+// Type MOD(+Shift)+key
+static void shortcut(xcb_keycode_t key, int shift)
+{
+    static xcb_keycode_t mod, shiftkey;
+
+    if(!mod)
+    {
+        mod = keycode(XK_Alt_L);
+        shiftkey = keycode(XK_Shift_L);
+    }
+
+    press(mod, 1);
+    if(shift)
+        press(shiftkey, 1);
+    press(key, 1);
+    press(key, 0);
+    if(shift)
+        press(shiftkey, 0);
+    press(mod, 0);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Per operation latencies are only known for the map workload, the others
+// report the wall clock time divided by the number of operations
+static void report(const char *name, int ops, uint64_t wall, wmstats *before, wmstats *after, uint64_t *latencies)
+{
+    unsigned long events, requests;
+    double avg = wall/1e3/ops, p99 = avg, max = avg;
+
+    exclude_syncs(before, after);
+    events = after->events - before->events;
+    requests = after->requests - before->requests;
+
+    if(latencies)
+    {
+        qsort(latencies, ops, sizeof(*latencies), cmp_u64);
+        p99 = latencies[(ops*99)/100 < ops ? (ops*99)/100 : ops-1]/1e3;
+        max = latencies[ops-1]/1e3;
+    }
+
+    printf("%-18s %7d %10.2f %11.0f %11.0f %8.2f %9.1f %9.1f %9.1f\n", name, ops, wall/1e6, ops/(wall/1e9),
+           events/(wall/1e9), (double)requests/ops, avg, p99, max);
+}
+
+static void bench_map()
+{
+    wmstats before, after;
+    uint64_t t;
+    int i;
+
+    for(i=0; i<nwindows; ++i)
+        windows[i] = create_window();
+    read_stats(&before);
+
+    t = timestamp();
+    for(i=0; i<nwindows; ++i)
+    {
+        sent[i] = timestamp();
+        xcb_map_window(connection, windows[i]);
+    }
+    wait_mapped(windows, nwindows, lat);
+    t = timestamp() - t;
+
+    for(i=0; i<nwindows; ++i)
+        lat[i] -= sent[i];
+
+    read_stats(&after);
+    report("map", nwindows, t, &before, &after, lat);
+}
+
+static void bench_switch()
+{
+    wmstats before, after;
+    xcb_keycode_t one = keycode(XK_1), two = keycode(XK_2);
+    uint64_t t;
+    int i;
+
+    read_stats(&before);
+
+    t = timestamp();
+    for(i=0; i<nswitches; ++i)
+        shortcut(i % 2 ? one : two, 0);
+    if(nswitches % 2)
+        shortcut(one, 0);
+    t = finish(t);
+
+    read_stats(&after);
+    report("desktop switch", nswitches + nswitches % 2, t, &before, &after, NULL);
+}
+
+static void bench_configure()
+{
+    wmstats before, after;
+    uint32_t values[4];
+    uint64_t t;
+    int i, j;
+
+    read_stats(&before);
+
+    t = timestamp();
+    for(j=0; j<nrounds; ++j)
+        for(i=0; i<nwindows; ++i)
+        {
+            values[0] = (i * 7 + j) % 800;
+            values[1] = (i * 13 + j) % 600;
+            values[2] = 100 + j;
+            values[3] = 100 + i % 50;
+            xcb_configure_window(connection, windows[i], XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+        }
+    t = finish(t);
+
+    read_stats(&after);
+    report("configure request", nwindows * nrounds, t, &before, &after, NULL);
+}
+
+static void bench_client_to_desktop()
+{
+    wmstats before, after;
+    xcb_keycode_t three = keycode(XK_3);
+    uint64_t t;
+    int i, n = nwindows / 2;
+
+    read_stats(&before);
+
+    // Send half of the windows to desktop 3, one focused window at a time
+    t = timestamp();
+    for(i=0; i<n; ++i)
+        shortcut(three, 1);
+    t = finish(t);
+
+    read_stats(&after);
+    report("client_to_desktop", n, t, &before, &after, NULL);
+}
+
+static void bench_destroy()
+{
+    wmstats before, after;
+    uint64_t t;
+    int i;
+
+    read_stats(&before);
+
+    // Half of them live on a hidden desktop by now
+    t = timestamp();
+    for(i=0; i<nwindows; ++i)
+        xcb_destroy_window(connection, windows[i]);
+    t = finish(t);
+
+    read_stats(&after);
+    report("destroy", nwindows, t, &before, &after, NULL);
+}
+
+// Leave the WM alone and count how often it wakes up anyway. Reading the
+// statistics still costs the wakeup of the signal.
+static void bench_idle()
+{
+    wmstats before, after;
+    uint64_t t;
+
+    read_stats(&before);
+    t = timestamp();
+    sleep(idle);
+    read_stats(&after);
+    t = timestamp() - t;
+    exclude_syncs(&before, &after);
+
+    printf("idle: %lu wakeups (%lu without events) in %.1f s, %.2f wakeups/s\n",
+           after.wakeups - before.wakeups, after.idle_wakeups - before.idle_wakeups, t/1e9,
+           (after.wakeups - before.wakeups)/(t/1e9));
+}
+
+int main(int argc, char **argv)
+{
+    char *wm = "./catwm-xcb";
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:n:k:r:i:")) != -1)
+        switch(opt)
+        {
+            case 'd': snprintf(display, sizeof(display), "%s", optarg); break;
+            case 'n': nwindows = atoi(optarg); break;
+            case 'k': nswitches = atoi(optarg); break;
+            case 'r': nrounds = atoi(optarg); break;
+            case 'i': idle = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d display] [-n windows] [-k switches] [-r rounds] [-i idle seconds] [catwm-xcb]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    if(optind < argc)
+        wm = argv[optind];
+
+    if(nwindows < 2 || nswitches < 1 || nrounds < 1)
+        die("need at least 2 windows, 1 switch and 1 round");
+
+    if(!(windows = calloc(nwindows, sizeof(*windows))) || !(sent = calloc(nwindows, sizeof(*sent))) || !(lat = calloc(nwindows, sizeof(*lat))))
+        die("calloc failed !");
+
+    start_xvfb();
+    start_wm(wm);
+    calibrate();
+
+    printf("%-18s %7s %10s %11s %11s %8s %9s %9s %9s\n", "workload", "ops", "wall ms", "ops/s", "events/s", "req/op", "avg us", "p99 us", "max us");
+    bench_map();
+    bench_switch();
+    bench_configure();
+    bench_client_to_desktop();
+    bench_destroy();
+    if(idle > 0)
+        bench_idle();
+
+    xcb_key_symbols_free(keysyms);
+    xcb_disconnect(connection);
+    cleanup();
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ *  layout-bench: times the layouts of catwm-xcb, no X server needed
+ *
+ *  See catwm-xcb.c for copyright and licence.
+ *
+ *  Each layout arranges 1 to N windows in a 1920x1080 area, first computed
+ *  every time, then through the cache as the WM does when nothing changed.
+ *  Every result is checked to stay within the area.
+ *
+ *  Usage: layout-bench [-n max windows] [-i iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../layout.h"
+
+static int nmax = 256;
+static int iterations = 100000;
+
+static void die(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "layout-bench: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t timestamp()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(const layout *l, int n, geometry area, const geometry *g)
+{
+    int i;
+
+    for(i=0; i<n; ++i)
+        if(g[i].x < area.x || g[i].y < area.y || g[i].w <= 0 || g[i].h <= 0 ||
+           g[i].x + g[i].w > area.x + area.w || g[i].y + g[i].h > area.y + area.h)
+            die("%s: window %d of %d is out of the area (%d,%d %dx%d)", l->name, i, n, g[i].x, g[i].y, g[i].w, g[i].h);
+}
+
+// Keep the compiler from dropping the work
+static volatile int sink;
+
+static void bench(const layout *l, int n, geometry area)
+{
+    layout_cache cache = {0};
+    const geometry *g = NULL;
+    geometry *buf;
+    uint64_t t, raw, cached;
+    int i, ms = area.w*0.6;
+
+    if(!(buf = calloc(n, sizeof(geometry))))
+        die("calloc failed !");
+
+    t = timestamp();
+    for(i=0; i<iterations; ++i)
+    {
+        l->arrange(n, ms, area, buf);
+        sink = buf[n-1].x;
+    }
+    raw = timestamp() - t;
+    check(l, n, area, buf);
+
+    t = timestamp();
+    for(i=0; i<iterations; ++i)
+    {
+        if(!(g = arrange(&cache, l, n, ms, area)))
+            die("malloc failed !");
+        sink = g[n-1].x;
+    }
+    cached = timestamp() - t;
+    check(l, n, area, g);
+
+    printf("%-10s %6d %12.1f %12.1f %10lu\n", l->name, n, (double)raw/iterations, (double)cached/iterations, cache.misses);
+
+    free(cache.g);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    geometry area = { 0, 0, 1920, 1080 };
+    int opt, i, n;
+
+    while((opt = getopt(argc, argv, "n:i:")) != -1)
+        switch(opt)
+        {
+            case 'n': nmax = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n max windows] [-i iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+    if(nmax < 1 || iterations < 1)
+        die("need at least 1 window and 1 iteration");
+
+    printf("%-10s %6s %12s %12s %10s\n", "layout", "n", "ns/arrange", "ns/cached", "computed");
+    for(i=0; i<nlayouts; ++i)
+        for(n=1; n<=nmax; n*=4)
+            bench(&layouts[i], n, area);
+
+    return 0;
+}
@@ -30,6 +30,7 @@
 *
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -37,16 +38,63 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <X11/keysym.h>
 #include <X11/XF86keysym.h>
 #include <X11/X.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_keysyms.h>
+#include <xcb/randr.h>
+
+#include "layout.h"
 
 #define TABLENGTH(X)    (sizeof(X)/sizeof(*X))
+#define MAX(A, B)       ((A) > (B) ? (A) : (B))
+#define MIN(A, B)       ((A) < (B) ? (A) : (B))
+
+// Remember the sequence number of the last request sent, the difference
+// between two of them is the number of requests issued in between.
+#define REQ(R)          (last_seq = (R).sequence)
+
+// How windows of the desktop we leave are hidden
+#define DESKTOP_HIDE    (HIDE_OFFSCREEN ? Offscreen : Unmapped)
+
+// Modifiers that matter for shortcuts
+#define MODMASK         (XCB_MOD_MASK_SHIFT | XCB_MOD_MASK_CONTROL | XCB_MOD_MASK_1 | XCB_MOD_MASK_2 | XCB_MOD_MASK_3 | XCB_MOD_MASK_4 | XCB_MOD_MASK_5)
+#define CLEANMASK(M)    ((M) & ~(numlockmask | XCB_MOD_MASK_LOCK) & MODMASK)
+
+// Record into the trace ring, if the level is compiled in and enabled.
+// T0 is when the traced work started. WM actions are traced at TRACE_INFO,
+// every X event at TRACE_EVENT.
+#define TRACE_INFO      1
+#define TRACE_EVENT     2
+#define TRACING(L)      ((L) <= TRACE_LEVEL && (L) <= trace_level)
+#define TRACE(L, T, W, T0) do { if(TRACING(L)) trace(L, T, W, T0); } while(0)
+#define TRACE_SIZE      4096
+
+// Time a call and count the requests it issues (nested calls included)
+#define PROFILE(P, CALL) do { uint64_t t_ = timestamp(); unsigned int s_ = last_seq; CALL; profile(P, t_, s_); } while(0)
+#define HISTBUCKETS     32
+
+// Work postponed to the end of the current event batch
+#define DIRTY_LAYOUT    (1 << 0)
+#define DIRTY_FOCUS     (1 << 1)
+#define DIRTY_CLIENTS   (1 << 2)
 
 typedef union
 {
@@ -65,63 +113,201 @@ struct key
 typedef struct client client;
 struct client
 {
-    client *next;
-    client *prev;
+    // Chain in the window index (or in the free pool), owning desktop and
+    // position in its client array
+    client *hnext;
+    int desktop;
+    int pos;
+
+    // Last geometry committed to the server
+    int x, y, w, h, bw;
+
+    // How we hid it (other desktop, monocle)
+    int hidden;
+
+    // Placed by its own requests instead of the layout
+    int floating;
+
+    // Cached properties, kept up to date from PropertyNotify.
+    // WM_PROTOCOLS it takes part in, -1 until the server told us.
+    int protocols;
+    char name[128];
+    char instance[64];
+    char class[64];
+    int min_w, min_h, max_w, max_h;
+    int urgent;
 
     xcb_window_t window;
 };
 
+// Client visibility
+enum { Shown, Unmapped, Offscreen };
+
+// WM_PROTOCOLS we care about
+enum { ProtoDelete = 1, ProtoPing = 2 };
+
+// Trace entries past the X event types
+enum { TraceSwitch = 128, TraceSpawn, TraceKill, TraceClose, TraceMonitors };
+
+// Client properties we cache
+enum { PropProtocols, PropName, PropClass, PropNormalHints, PropHints, PropLast };
+
+// Profiled handlers
+enum { ProfMapRequest, ProfDestroyNotify, ProfConfigureRequest, ProfKeyPress, ProfTile, ProfLayout, ProfUpdateCurrent, ProfSpawn, ProfLast };
+
+// Atoms we intern at startup, the ones we support from NetSupported on
+enum { WMState, WMProtocols, WMDeleteWindow, UTF8String, NetSupported, NetSupportingWMCheck, NetWMName, NetClientList, NetNumberOfDesktops,
+       NetCurrentDesktop, NetActiveWindow, NetWMPing, WMLast };
+
 typedef struct desktop desktop;
 struct desktop
 {
+    int id;
     int master_size;
     int mode;
-    client *head;
+    client **clients;
+    int nclients;
+    int size;
     client *current;
+
+    // Monitor showing it, -1 when hidden
+    int mon;
+
+    // Last geometry computed for it
+    layout_cache cache;
+};
+
+// An output (a RandR CRTC, or the whole root window without RandR) and the
+// desktop it shows
+typedef struct monitor monitor;
+struct monitor
+{
+    uint32_t crtc;
+    int x, y, w, h;
+    int desktop;
+
+    // Refresh rate in Hz, 0 when unknown
+    int refresh;
+
+    // Its desktop needs a relayout
+    int dirty;
 };
 
 // Functions
 static void add_window(xcb_window_t w);
+static client *alloc_client();
+static void arm_timer(int t, uint64_t ns, uint64_t interval_ns);
+static void attach(client *c);
+static void buttonpress(xcb_button_press_event_t *e);
+static void buttonrelease(xcb_button_release_event_t *e);
 static void change_desktop(const Arg arg);
+static void commit();
 static void client_to_desktop(const Arg arg);
+static void clientmessage(xcb_client_message_event_t *e);
 static void configurenotify(xcb_configure_notify_event_t *e);
+static void control();
+static void crash(int sig);
 static void configurerequest(xcb_configure_request_event_t *e);
 static void decrease();
+static int desktop_index(int id);
+static void defer(void (*func)());
 static void destroynotify(xcb_destroy_notify_event_t *e);
+static void detach(client *c);
 static void die(const char *format, ...);
-static unsigned long get_color(const char* color);
+static void dump_trace();
+static void drag_window(int force);
+static void dumpstats();
+static void expire(int t);
+static int find_closing(xcb_window_t w);
+static desktop *find_desktop(int id);
+static char *fmtnum(char *p, uint64_t v, int base, int width);
+static void flush_configures();
+static void free_client(client *c);
+static void get_class(xcb_window_t w, void *reply);
+static desktop *get_desktop(int id);
+static void get_hints(xcb_window_t w, void *reply);
+static void get_name(xcb_window_t w, void *reply);
+static void get_normal_hints(xcb_window_t w, void *reply);
+static void get_protocols(xcb_window_t w, void *reply);
+static void get_property(xcb_window_t w, int p);
+static xcb_alloc_color_cookie_t alloc_color(const char* color);
+static unsigned long get_color(xcb_alloc_color_cookie_t cookie, const char* color);
 static void grabkeys();
+static void hide_client(client *c, int how);
+static void handle_event(xcb_generic_event_t *ge);
+static void handle_signals();
 static void increase();
+static void index_client(client *c);
+static void invalidate_geometry(client *c);
 static void keypress(xcb_key_press_event_t *e);
+static void kill_expired();
 static void kill_client();
+static void launch(const char **argv);
+static void mappingnotify(xcb_mapping_notify_event_t *e);
 static void maprequest(xcb_map_request_event_t *e);
 static void move_down();
 static void move_up();
+static void motionnotify(xcb_motion_notify_event_t *e);
+static void move_window(client *c, int x, int y, int w, int h);
 static void next_desktop();
+static void next_monitor();
 static void next_win();
+static void poll_replies();
 static void prev_desktop();
 static void prev_win();
+static void profile(int p, uint64_t t, unsigned int seq);
+static void propertynotify(xcb_property_notify_event_t *e);
 static void quit();
+static void randrnotify();
+static int read_string(FILE *f, char *s, int size, int len);
+static void release_desktop(int id);
 static void remove_window(xcb_window_t w);
+static void restart();
+static void restore_state();
+static void run_deferred();
 static void save_desktop(int i);
+static int save_state();
+static void scan(xcb_query_tree_cookie_t cookie);
 static void select_desktop(int i);
 //static void send_kill_signal(xcb_window_t w);
+static void send_protocol(xcb_window_t w, xcb_atom_t protocol);
+static void set_wm_state(client *c, uint32_t state);
 static void setup();
-static void sigchld(int unused);
+static void setup_control();
+static void setup_ewmh();
+static void setup_loop();
+static void setup_trace();
+static void show_client(client *c);
 static void spawn(const Arg arg);
+static void start_helper();
 static void start();
-//static void swap();
+static void step_desktop(int dir);
+static void swap(client *a, client *b);
 static void swap_master();
+static uint64_t timestamp();
 static void switch_mode();
 static void tile();
+static void trace(int level, int type, xcb_window_t w, uint64_t t0);
+static void trace_level_set(const Arg arg);
+static void toggle_floating();
+static void tile_monitor(int i);
+static void update_net_desktop();
+static void update_numlockmask(xcb_get_modifier_mapping_cookie_t cookie);
+static void update_client_list();
 static void update_current();
+static void update_monitors(xcb_randr_get_screen_resources_current_cookie_t cookie);
+static void wait_reply(unsigned int sequence, xcb_window_t w, void (*handler)(xcb_window_t w, void *reply));
+static void watch(int fd, uint32_t id);
+static client *wintoclient(xcb_window_t w);
 
 // Include configuration file (need struct key)
 #include "config.h"
 
 // Variable
+extern char **environ;
 static xcb_connection_t *connection;
 static int bool_quit;
+static int bool_restart;
 static int current_desktop;
 static int master_size;
 static int mode;
@@ -130,610 +316,2768 @@ static int sw;
 static int screenNum;
 static unsigned int win_focus;
 static unsigned int win_unfocus;
-static client *head;
+static client **clients;
+static int nclients;
+static int clients_size;
 static client *current;
+static client *focused;
+static int dirty;
+static unsigned int last_seq;
+static uint64_t start_ns;
+static xcb_atom_t wmatom[WMLast];
+static const char *wmatomnames[WMLast] = { "WM_STATE", "WM_PROTOCOLS", "WM_DELETE_WINDOW", "UTF8_STRING",
+    "_NET_SUPPORTED", "_NET_SUPPORTING_WM_CHECK", "_NET_WM_NAME", "_NET_CLIENT_LIST", "_NET_NUMBER_OF_DESKTOPS", "_NET_CURRENT_DESKTOP", "_NET_ACTIVE_WINDOW", "_NET_WM_PING" };
+
+// What the root window properties say, in mapping order for the client list
+static xcb_window_t *netclients;
+static int nnetclients;
+static int netclients_size;
+static int net_desktop = -1;
+static int net_ndesktops = -1;
+static xcb_window_t net_active;
+
+// Event loop counters, dumped on SIGUSR1
+static struct
+{
+    unsigned long events;
+    unsigned long batches;
+    unsigned long requests;
+
+    // ConfigureRequests, and what we did about them
+    unsigned long configures;
+    unsigned long configures_sent;
+    unsigned long configures_synthetic;
+
+    // Pointer drags: motion events received, configures they turned into
+    unsigned long motions;
+    unsigned long drag_configures;
+
+    // Desktop switches
+    unsigned long switches;
+    unsigned long switch_requests;
+    uint64_t switch_ns;
+    uint64_t switch_max_ns;
+
+    // Layouts of the workspaces freed so far
+    unsigned long layout_hits;
+    unsigned long layout_misses;
+
+    // Startup
+    uint64_t setup_ns;
+    uint64_t first_event_ns;
+    unsigned long adopted;
+    unsigned long restored;
+
+    // Main loop wakeups, idle ones had no X event to handle
+    unsigned long wakeups;
+    unsigned long idle_wakeups;
+} stats;
+
+// Per event type counters and handler latencies (log2 buckets in ns)
+static unsigned long evcount[128];
+static struct
+{
+    unsigned long calls;
+    unsigned long requests;
+    uint64_t ns;
+    uint64_t max_ns;
+    unsigned long hist[HISTBUCKETS];
+} prof[ProfLast];
+
+static const char *profnames[ProfLast] = { "maprequest", "destroynotify", "configurerequest", "keypress", "tile", "layout", "update_current", "spawn" };
+static const char *evnames[] = {
+    "Error", "Reply", "KeyPress", "KeyRelease", "ButtonPress", "ButtonRelease", "MotionNotify",
+    "EnterNotify", "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExpose",
+    "NoExposure", "VisibilityNotify", "CreateNotify", "DestroyNotify", "UnmapNotify", "MapNotify",
+    "MapRequest", "ReparentNotify", "ConfigureNotify", "ConfigureRequest", "GravityNotify",
+    "ResizeRequest", "CirculateNotify", "CirculateRequest", "PropertyNotify", "SelectionClear",
+    "SelectionRequest", "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify",
+    "GenericEvent"
+};
 
 xcb_key_symbols_t *keysyms;
 
-// Desktop array
-static desktop desktops[10];
+// Shortcuts by keycode, bindings sharing a keycode are chained
+typedef struct keybind keybind;
+struct keybind
+{
+    const struct key *key;
+    int next;
+};
+static keybind *keybinds;
+static int nkeybinds;
+static int keybinds_size;
+static int keyhead[256];
+static uint16_t numlockmask;
+
+// Workspaces in use, sorted by id. One is created when it is first selected
+// or given a window, and freed once it has none and is out of sight.
+static desktop **desktops;
+static int ndesktops;
+static int desktops_size;
+
+// Outputs, the selected one shows current_desktop
+#define MAXMONITORS     8
+static monitor monitors[MAXMONITORS];
+static int nmonitors;
+static int selmon;
+static int randr_base = -1;
 xcb_screen_t *screen;
 
-xcb_keysym_t keycode_to_keysym(xcb_keycode_t keycode)
+// Clients are carved out of chunks that are never given back, freed ones
+// wait in a pool for the next window
+#define POOL_CHUNK      64
+static client *pool;
+
+// Control socket
+static int ctlfd = -1;
+static struct sockaddr_un ctladdr;
+
+// Control socket commands: a letter, optionally followed by a number. A
+// datagram may hold several commands separated by newlines.
+static const struct command
+{
+    char name;
+    void (*function)(const Arg arg);
+    int desktop;
+} commands[] = {
+    { 'd', change_desktop,      1 },
+    { 'c', client_to_desktop,   1 },
+    { 'm', switch_mode,         0 },
+    { '+', increase,            0 },
+    { '-', decrease,            0 },
+    { 'n', next_win,            0 },
+    { 'p', prev_win,            0 },
+    { 'o', next_monitor,        0 },
+    { 'f', toggle_floating,     0 },
+    { 't', trace_level_set,     0 },
+    { 'r', restart,             0 },
+    { 'q', quit,                0 },
+};
+
+// Children are reaped from the main loop, spawned directly or by a helper
+static int sigfd = -1;
+static int helperfd = -1;
+
+// Main loop wakeup sources, timers come last
+enum { WatchX, WatchControl, WatchSignal, WatchTimer };
+enum { TimerBatch, TimerStats, TimerDrag, TimerKill, TimerLast };
+
+static int epfd = -1;
+static int timerfd[TimerLast];
+static int batch_armed, batch_due;
+
+// ConfigureRequests of the current batch, one per window. Values are kept
+// at the position of their bit in the mask.
+static struct pending
+{
+    xcb_window_t window;
+    uint16_t mask;
+    uint32_t values[7];
+    int next;
+} *pending;
+static int npending;
+static int pending_size;
+
+// Pointer drag in progress. Motion only records the latest position,
+// drag_window() applies it at most once per frame.
+static struct
+{
+    client *c;
+    int button;
+    int px, py;
+    int x, y, w, h;
+    int rx, ry;
+    int moved;
+    int timer_armed;
+    uint64_t last_ns;
+    uint64_t period_ns;
+} drag;
+
+// How to fetch the cached properties, their atom and what to do with
+// their value. WM_PROTOCOLS is interned at startup.
+static struct property
+{
+    xcb_atom_t atom;
+    uint32_t length;
+    void (*handler)(xcb_window_t w, void *reply);
+} properties[PropLast] = {
+    { XCB_NONE,                 32,     get_protocols },
+    { XCB_ATOM_WM_NAME,         32,     get_name },
+    { XCB_ATOM_WM_CLASS,        32,     get_class },
+    { XCB_ATOM_WM_NORMAL_HINTS, 18,     get_normal_hints },
+    { XCB_ATOM_WM_HINTS,        9,      get_hints },
+};
+
+// Replies we wait for without blocking, in request order
+static struct reply_wait
+{
+    unsigned int sequence;
+    xcb_window_t window;
+    void (*handler)(xcb_window_t w, void *reply);
+} *waits;
+static int waits_head;
+static int nwaits;
+static int waits_size;
+
+// Windows asked to close. The ones we pinged are killed if no pong came
+// back by their deadline, the others have none and wait for a second
+// kill_client().
+static struct closing
+{
+    xcb_window_t window;
+    uint64_t deadline;
+} closing[32];
+static int nclosing;
+
+// Restart state, in a memfd kept open across exec: a header, the monitors,
+// then each desktop followed by its clients in order. Only the same binary
+// layout is read back, the version changes with it.
+#define STATE_MAGIC     0x4d574143
+#define STATE_VERSION   2
+
+struct state_header
+{
+    uint32_t magic, version;
+    int32_t ndesktops, nmonitors, nclients;
+    uint32_t selcrtc;
+};
+
+struct state_monitor
+{
+    uint32_t crtc;
+    int32_t desktop;
+};
+
+struct state_desktop
+{
+    int32_t id, master_size, mode, nclients, current;
+};
+
+// Followed by the name, instance and class, without their NUL
+struct state_client
+{
+    uint32_t window;
+
+    // Position in the client list
+    uint32_t order;
+    int16_t x, y, w, h, bw;
+    int16_t min_w, min_h, max_w, max_h;
+    int8_t protocols;
+    uint8_t hidden, floating, urgent;
+    uint8_t name_len, instance_len, class_len;
+};
+
+// Trace ring: the last TRACE_SIZE events and actions with their duration.
+// Recording never blocks, the ring is only written out when asked for or
+// when we crash.
+static struct trace_entry
+{
+    uint64_t ns;
+    uint32_t dur_ns;
+    xcb_window_t window;
+    uint8_t type;
+    uint8_t level;
+} tracebuf[TRACE_SIZE];
+static unsigned long tracepos;
+static int trace_level = TRACE_LEVEL;
+static const char *tracenames[] = { "switch", "spawn", "kill", "close", "monitors" };
+
+// Work deferred to the end of the current batch
+static void (*deferred[16])();
+static int ndeferred;
+
+// Window index, shared by all desktops
+#define WINTABLE_BITS   8
+#define WINTABLE_SIZE   (1 << WINTABLE_BITS)
+static client *wintable[WINTABLE_SIZE];
+
+// Pending ConfigureRequests by window, as index + 1 of the first of the
+// bucket in pending[], chained through next
+static int pendingtable[WINTABLE_SIZE];
+
+// Window ids of one X client only differ in their low bits, Fibonacci hashing spreads them
+static unsigned int winhash(xcb_window_t w)
 {
-    return xcb_key_symbols_get_keysym(keysyms, keycode, 0);
+    return (uint32_t)(w * 2654435761u) >> (32 - WINTABLE_BITS);
 }
 
 void add_window(xcb_window_t w)
 {
-    client *c,*t;
+    client *c = alloc_client();
+    const uint32_t values[] = {win_unfocus, XCB_EVENT_MASK_PROPERTY_CHANGE};
+    int i;
 
-    if(!(c = (client *)calloc(1,sizeof(client))))
-        die("calloc failed !");
+    c->window = w;
+    c->desktop = current_desktop;
+    invalidate_geometry(c);
+    attach(c);
+    index_client(c);
+
+    // Every window but the focused one wears the unfocused border, and we
+    // follow its properties
+    REQ(xcb_change_window_attributes(connection, w, XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK, values));
 
-    if(head == NULL)
+    // Its properties, all asked at once and answered while we do something else
+    c->protocols = -1;
+    for(i=0; i<PropLast; ++i)
+        get_property(w, i);
+
+    // New windows go at the end of the client list, no need to rewrite it
+    if(nnetclients == netclients_size)
     {
-        c->next = NULL;
-        c->prev = NULL;
-        c->window = w;
-        head = c;
+        netclients_size = netclients_size ? 2*netclients_size : 32;
+        if(!(netclients = realloc(netclients, netclients_size*sizeof(xcb_window_t))))
+            die("realloc failed !");
     }
-    else
+    netclients[nnetclients++] = w;
+    if(!(dirty & DIRTY_CLIENTS))
+        REQ(xcb_change_property(connection, XCB_PROP_MODE_APPEND, screen->root, wmatom[NetClientList], XCB_ATOM_WINDOW, 32, 1, &w));
+
+    current = c;
+}
+
+// A zeroed client, from the pool when one is free
+client *alloc_client()
+{
+    client *c;
+    int i;
+
+    if(pool == NULL)
     {
-        for(t=head; t->next; t=t->next);
+        if(!(c = (client *)calloc(POOL_CHUNK,sizeof(client))))
+            die("calloc failed !");
+
+        for(i=0; i<POOL_CHUNK; ++i)
+        {
+            c[i].hnext = pool;
+            pool = &c[i];
+        }
+    }
 
-        c->next = NULL;
-        c->prev = t;
-        c->window = w;
+    c = pool;
+    pool = c->hnext;
+    memset(c, 0, sizeof(client));
 
-        t->next = c;
+    return c;
+}
+
+void arm_timer(int t, uint64_t ns, uint64_t interval_ns)
+{
+    struct itimerspec its = {
+        .it_interval = { interval_ns / 1000000000, interval_ns % 1000000000 },
+        .it_value = { ns / 1000000000, ns % 1000000000 },
+    };
+
+    // A zero value disarms the timer
+    if(timerfd_settime(timerfd[t], 0, &its, NULL) < 0)
+        fprintf(stderr, "catwm-xcb: cannot arm timer %d\n", t);
+}
+
+// Append a client to the selected desktop
+void attach(client *c)
+{
+    if(nclients == clients_size)
+    {
+        clients_size = clients_size ? 2*clients_size : 8;
+        if(!(clients = realloc(clients, clients_size*sizeof(client*))))
+            die("realloc failed !");
     }
 
+    c->pos = nclients;
+    clients[nclients++] = c;
+}
+
+// MOD+button on a window starts dragging it, and it floats from then on.
+// The passive grab reports motion and release to us until the button is up.
+void buttonpress(xcb_button_press_event_t *e)
+{
+    const uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+    xcb_get_geometry_reply_t *geom;
+    client *c;
+    int refresh;
+
+    if(drag.c || !(c = wintoclient(e->child)))
+        return;
+
+    // Focus it, on its own monitor
+    if(c->desktop != current_desktop)
+    {
+        Arg a = {.i = c->desktop};
+        change_desktop(a);
+    }
     current = c;
+    dirty |= DIRTY_FOCUS;
+
+    if(!c->floating)
+    {
+        c->floating = 1;
+        dirty |= DIRTY_LAYOUT;
+    }
+
+    // Where it stands, asking only if we lost track
+    if(c->w < 0)
+    {
+        if(!(geom = xcb_get_geometry_reply(connection, xcb_get_geometry(connection, c->window), NULL)))
+            return;
+        c->x = geom->x;
+        c->y = geom->y;
+        c->w = geom->width;
+        c->h = geom->height;
+        c->bw = geom->border_width;
+        free(geom);
+    }
+
+    drag.c = c;
+    drag.button = e->detail;
+    drag.px = drag.rx = e->root_x;
+    drag.py = drag.ry = e->root_y;
+    drag.x = c->x;
+    drag.y = c->y;
+    drag.w = c->w;
+    drag.h = c->h;
+    drag.moved = 0;
+    drag.last_ns = 0;
+
+    // One configure per frame of the monitor it is on
+    refresh = monitors[get_desktop(c->desktop)->mon].refresh;
+    drag.period_ns = 1000000000ULL / (refresh ? refresh : DRAG_RATE);
+
+    REQ(xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_STACK_MODE, values));
+}
+
+void buttonrelease(xcb_button_release_event_t *e)
+{
+    if(!drag.c || e->detail != drag.button)
+        return;
+
+    // The last position always makes it
+    drag.rx = e->root_x;
+    drag.ry = e->root_y;
+    drag.moved = 1;
+    drag_window(1);
+    drag.c = NULL;
 }
 
 void change_desktop(const Arg arg)
 {
-    client *c;
+    client **old;
+    int i, nold, prev = current_desktop;
+    unsigned int seq = last_seq;
+    uint64_t t, dt;
 
     if(arg.i == current_desktop)
         return;
 
-    // Unmap all window
-    if(head != NULL)
-        for(c=head; c; c=c->next)
-            xcb_unmap_window(connection, c->window);
+    // Already shown on another monitor: just move there
+    if(get_desktop(arg.i)->mon >= 0)
+    {
+        save_desktop(current_desktop);
+        selmon = get_desktop(arg.i)->mon;
+        select_desktop(arg.i);
+        update_net_desktop();
+        dirty |= DIRTY_FOCUS;
+        return;
+    }
+
+    t = timestamp();
+
+    // Commit the whole switch at once, the server never shows half of it
+    if(GRAB_ON_SWITCH)
+        REQ(xcb_grab_server(connection));
 
     // Save current "properties"
+    old = clients;
+    nold = nclients;
     save_desktop(current_desktop);
 
-    // Take "properties" from the new desktop
+    // Take "properties" from the new desktop and lay it out on our monitor
+    get_desktop(current_desktop)->mon = -1;
     select_desktop(arg.i);
-
-    // Map all windows
-    if(head != NULL)
-        for(c=head; c; c=c->next)
-            xcb_map_window(connection, c->window);
-
-    tile();
-    update_current();
+    get_desktop(arg.i)->mon = selmon;
+    monitors[selmon].desktop = arg.i;
+    PROFILE(ProfTile, tile());
+    PROFILE(ProfUpdateCurrent, update_current());
+    dirty &= ~(DIRTY_LAYOUT | DIRTY_FOCUS);
+
+    // Then hide the old windows
+    for(i=0; i<nold; ++i)
+        hide_client(old[i], DESKTOP_HIDE);
+
+    // Nothing left to come back to
+    release_desktop(prev);
+    update_net_desktop();
+
+    if(GRAB_ON_SWITCH)
+        REQ(xcb_ungrab_server(connection));
+
+    // Optionally wait for the server to be done for the statistics
+    if(SWITCH_SYNC)
+        free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL));
+    else
+        xcb_flush(connection);
+
+    dt = timestamp() - t;
+    TRACE(TRACE_INFO, TraceSwitch, XCB_NONE, t);
+    ++stats.switches;
+    stats.switch_requests += last_seq - seq;
+    stats.switch_ns += dt;
+    if(dt > stats.switch_max_ns)
+        stats.switch_max_ns = dt;
 }
 
 void client_to_desktop(const Arg arg)
 {
-    client *tmp = current;
-    int tmp2 = current_desktop;
+    client *c = current;
+    int tmp = current_desktop;
 
     if(arg.i == current_desktop || current == NULL)
         return;
 
+    // Remove client from current desktop, the monitor showing its new
+    // desktop if any lays it out again
+    detach(c);
+    if(get_desktop(arg.i)->mon < 0)
+        hide_client(c, DESKTOP_HIDE);
+    else
+        monitors[get_desktop(arg.i)->mon].dirty = 1;
+    save_desktop(tmp);
+
     // Add client to desktop
     select_desktop(arg.i);
-    add_window(tmp->window);
+    attach(c);
+    c->desktop = arg.i;
+    current = c;
     save_desktop(arg.i);
 
-    // Remove client from current desktop
-    select_desktop(tmp2);
-    remove_window(current->window);
+    select_desktop(tmp);
 
-    tile();
-    update_current();
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
 }
 
-void configurenotify(xcb_configure_notify_event_t *e)
+// Pongs come back to the root window: the client is alive, let it close
+// in its own time
+void clientmessage(xcb_client_message_event_t *e)
 {
-    // Do nothing for the moment
-}
+    int i;
 
-void configurerequest(xcb_configure_request_event_t *e)
-{
-    const uint32_t values[] = {e->x, e->y, e->width, e->height, e->border_width, e->sibling, e->stack_mode};
-    xcb_configure_window(connection, e->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_BORDER_WIDTH | XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE, values);
-}
+    if(e->window != screen->root || e->type != wmatom[WMProtocols] || e->format != 32 || e->data.data32[0] != wmatom[NetWMPing])
+        return;
 
-void decrease()
-{
-    if(master_size > 50)
-    {
-        master_size -= 10;
-        tile();
-    }
+    if((i = find_closing(e->data.data32[2])) >= 0)
+        closing[i].deadline = 0;
 }
 
-void destroynotify(xcb_destroy_notify_event_t *e)
+// Apply the work collected during an event batch in one go
+void commit()
 {
-    int i = 0;
-    client *c = NULL;
+    int i;
 
-    // Uber (and ugly) hack
-    for(c=head; c; c=c->next)
-        if(e->window == c->window)
-            i++;
-    // End of the hack
+    // Other monitors only relayout when something changed on them
+    for(i=0; i<nmonitors; ++i)
+        if(monitors[i].dirty)
+        {
+            if(i == selmon)
+                dirty |= DIRTY_LAYOUT;
+            else
+                tile_monitor(i);
+            monitors[i].dirty = 0;
+        }
 
-    if(i == 0)
-        return;
+    if(dirty & DIRTY_LAYOUT)
+        PROFILE(ProfTile, tile());
 
-    remove_window(e->window);
-    tile();
-    update_current();
-}
+    if(dirty & DIRTY_FOCUS)
+        PROFILE(ProfUpdateCurrent, update_current());
 
-void die(const char *format, ...)
-{
-    va_list vargs;
+    if(dirty & DIRTY_CLIENTS)
+        update_client_list();
 
-    va_start(vargs, format);
-    fprintf(stderr, "catwm-xcb: ");
-    vfprintf(stderr, format, vargs);
-    fprintf(stderr, "\n");
-    exit(EXIT_FAILURE);
-}
+    if(npending)
+        flush_configures();
 
-// Thanks monsterwm
-static unsigned int get_colorpixel(const char *hex)
-{
-    char strgroups[3][3]  = {{hex[1], hex[2], '\0'}, {hex[3], hex[4], '\0'}, {hex[5], hex[6], '\0'}};
-    unsigned int rgb16[3] = {(strtol(strgroups[0], NULL, 16)), (strtol(strgroups[1], NULL, 16)), (strtol(strgroups[2], NULL, 16))};
-    return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
+    // The selected monitor may have changed under us
+    update_net_desktop();
+
+    dirty = 0;
+    xcb_flush(connection);
 }
 
-// ras
-unsigned long get_color(const char* color)
+void configurenotify(xcb_configure_notify_event_t *e)
 {
-    xcb_colormap_t map = screen->default_colormap;
-    xcb_alloc_color_reply_t *c;
-    unsigned long pixel, rgb = get_colorpixel(color);
-
-    c = xcb_alloc_color_reply(connection, xcb_alloc_color(connection, map, (rgb >> 16) * 257, (rgb >> 8 & 255) * 257, (rgb & 256)* 257), NULL);
-    if (!c)
-        die("cannot allocate color '%s'", color);
+    if(e->window != screen->root)
+        return;
 
-    pixel = c->pixel;
-    free(c);
-    return pixel;
+    // Without RandR the root window is our only monitor
+    sw = e->width;
+    sh = e->height;
+    if(randr_base < 0 && (monitors[0].w != sw || monitors[0].h != sh))
+    {
+        monitors[0].w = sw;
+        monitors[0].h = sh;
+        monitors[0].dirty = 1;
+    }
 }
 
-void grabkeys()
+// Requests are only recorded here, flush_configures() answers them once
+// the batch is laid out
+void configurerequest(xcb_configure_request_event_t *e)
 {
+    const uint32_t values[] = {e->x, e->y, e->width, e->height, e->border_width, e->sibling, e->stack_mode};
+    unsigned int h = winhash(e->window);
+    struct pending *p;
     int i;
-    xcb_keycode_t *code = NULL;
 
-    xcb_ungrab_key(connection, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
+    ++stats.configures;
 
-    // For every shortcuts
-    for(i=0; i<TABLENGTH(keys); ++i)
-        if((code = xcb_key_symbols_get_keycode(keysyms, keys[i].keysym)))
-            xcb_grab_key(connection, 1, screen->root, keys[i].mod, *code, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-}
+    for(i=pendingtable[h]-1; i >= 0 && pending[i].window != e->window; i = pending[i].next);
 
-void increase()
-{
-    if(master_size < sw-50)
+    if(i < 0)
     {
-        master_size += 10;
-        tile();
+        if(npending == pending_size)
+        {
+            pending_size = pending_size ? 2*pending_size : 8;
+            if(!(pending = realloc(pending, pending_size*sizeof(*pending))))
+                die("realloc failed !");
+        }
+        i = npending++;
+        pending[i].window = e->window;
+        pending[i].mask = 0;
+        pending[i].next = pendingtable[h]-1;
+        pendingtable[h] = i+1;
     }
+
+    // Later values win
+    p = &pending[i];
+    p->mask |= e->value_mask;
+    for(i=0; i<TABLENGTH(values); ++i)
+        if(e->value_mask & (1 << i))
+            p->values[i] = values[i];
 }
 
-void keypress(xcb_key_press_event_t *e)
+// Run the commands waiting on the control socket
+void control()
 {
-    int i;
-    xcb_keysym_t keysym = keycode_to_keysym(e->detail);
+    char buf[256], *line, *next, *end;
+    ssize_t len;
+    long n;
+    int i, given;
 
-    for(i=0; i<TABLENGTH(keys); ++i)
-        if(keys[i].keysym == keysym && keys[i].mod == e->state)
-            keys[i].function(keys[i].arg);
+    while((len = recv(ctlfd, buf, sizeof(buf)-1, 0)) > 0)
+    {
+        buf[len] = '\0';
+
+        for(line = buf; line; line = next)
+        {
+            if((next = strchr(line, '\n')))
+                *next++ = '\0';
+
+            if(!line[0])
+                continue;
+
+            // Anything but spaces after the number spoils the line
+            errno = 0;
+            n = strtol(line+1, &end, 10);
+            given = end != line+1;
+            while(*end == ' ')
+                ++end;
+            if(*end || errno || n != (int)n)
+                continue;
+
+            for(i=0; i<TABLENGTH(commands); ++i)
+                if(commands[i].name == line[0])
+                {
+                    const Arg arg = {.i = n};
+
+                    // Desktops are created on demand: no id means no
+                    // desktop, and ids stay below MAX_DESKTOPS
+                    if(!commands[i].desktop || (given && n >= 0 && n < MAX_DESKTOPS))
+                        commands[i].function(arg);
+                    break;
+                }
+        }
+    }
 }
 
-xcb_atom_t get_intern_atom(const char *name)
+// Leave the trace behind, then die of the same signal
+void crash(int sig)
 {
-    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(connection, xcb_intern_atom(connection, 0, strlen(name), name), NULL);
-
-    if(!reply)
-        die("couldn't retrieve atom %s", name);
+    static const char msg[] = "catwm-xcb: crashed, last events:\n";
 
-    xcb_atom_t ret = reply->atom;
+    if(write(STDERR_FILENO, msg, sizeof(msg)-1) < 0)
+        _exit(EXIT_FAILURE);
+    dump_trace();
 
-    free(reply);
-    return ret;
+    // The handler was reset when we got here
+    raise(sig);
 }
 
-// WARNING: this is NOT ICCCM-compliant !
-void kill_client()
+void decrease()
 {
-    if(current != NULL)
-        xcb_kill_client(connection, current->window);
- }
+    if(master_size > 50)
+    {
+        master_size -= 10;
+        dirty |= DIRTY_LAYOUT;
+    }
+}
 
-void maprequest(xcb_map_request_event_t *e)
+void defer(void (*func)())
 {
-    // In case the client has already made a map request but yields another one later on.
-    client *c;
-    for(c=head; c; c=c->next)
-        if(e->window == c->window)
-        {
-            xcb_map_window(connection, e->window);
+    int i;
+
+    // Deferring twice in a batch runs the work once
+    for(i=0; i<ndeferred; ++i)
+        if(deferred[i] == func)
             return;
-        }
 
-    // Otherwise, it is the first time we hear about it.
-    add_window(e->window);
-    xcb_map_window(connection, e->window);
-    tile();
-    update_current();
+    if(ndeferred < TABLENGTH(deferred))
+        deferred[ndeferred++] = func;
 }
 
-void move_down()
+// Position of a workspace in desktops[], or where it would go
+int desktop_index(int id)
 {
-    xcb_window_t tmp;
-    if(current == NULL || current->next == NULL || current->window == head->window || current->prev == NULL)
+    int lo = 0, hi = ndesktops, mid;
+
+    while(lo < hi)
     {
-        return;
+        mid = (lo + hi)/2;
+        if(desktops[mid]->id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    tmp = current->window;
-    current->window = current->next->window;
-    current->next->window = tmp;
-    //keep the moved window activated
-    next_win();
-    tile();
-    update_current();
+
+    return lo;
 }
 
-void move_up()
+void destroynotify(xcb_destroy_notify_event_t *e)
 {
-    xcb_window_t tmp;
+    client *c;
+    desktop *dk;
+    int d;
 
-    if(current == NULL || current->prev == head || current->window == head->window)
+    if(!(c = wintoclient(e->window)))
         return;
 
-    tmp = current->window;
-    current->window = current->prev->window;
-    current->prev->window = tmp;
-    prev_win();
-    tile();
-    update_current();
-}
-
-void next_desktop()
-{
-    int tmp = current_desktop;
-    if(tmp== 9)
-        tmp = 0;
-    else
-        tmp++;
+    // Windows of hidden desktops just leave their list, which may go with
+    // its last window
+    d = c->desktop;
+    remove_window(e->window);
 
-    Arg a = {.i = tmp};
-    change_desktop(a);
+    if(d == current_desktop)
+        dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+    else if((dk = find_desktop(d)) && dk->mon >= 0)
+        monitors[dk->mon].dirty = 1;
 }
 
-void next_win()
+// Take a client out of the selected desktop, the ones after it move up
+void detach(client *c)
 {
-    client *c;
+    int i;
 
-    if(current != NULL && head != NULL)
-    {
-        if(current->next == NULL)
-            c = head;
-        else
-            c = current->next;
+    --nclients;
+    memmove(&clients[c->pos], &clients[c->pos+1], (nclients-c->pos)*sizeof(client*));
+    for(i=c->pos; i<nclients; ++i)
+        clients[i]->pos = i;
 
-        current = c;
-        update_current();
-    }
+    if(current == c)
+        current = nclients ? clients[c->pos ? c->pos-1 : 0] : NULL;
 }
 
-void prev_desktop()
+void die(const char *format, ...)
 {
-    int tmp = current_desktop;
-    if(tmp == 0)
-        tmp = 9;
-    else
-        tmp--;
+    va_list vargs;
 
-    Arg a = {.i = tmp};
-    change_desktop(a);
+    va_start(vargs, format);
+    fprintf(stderr, "catwm-xcb: ");
+    vfprintf(stderr, format, vargs);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
 }
 
-void prev_win()
+// Oldest entry first. Only write() and our own formatting: this runs from
+// the crash handler too.
+void dump_trace()
 {
-    client *c;
+    char line[160], *p;
+    const char *name;
+    struct trace_entry *e;
+    unsigned long i;
+    size_t len;
 
-    if(current != NULL && head != NULL)
+    for(i = tracepos > TRACE_SIZE ? tracepos - TRACE_SIZE : 0; i < tracepos; ++i)
     {
-        if(current->prev == NULL)
-            for(c=head; c->next; c=c->next);
-        else
-            c = current->prev;
+        e = &tracebuf[i & (TRACE_SIZE-1)];
 
-        current = c;
-        update_current();
+        if(e->type >= TraceSwitch)
+            name = tracenames[e->type - TraceSwitch];
+        else if(e->type < TABLENGTH(evnames))
+            name = evnames[e->type];
+        else
+            name = "Extension";
+
+        p = line;
+        memcpy(p, "catwm-xcb: trace ", 17);
+        p = fmtnum(p+17, e->ns / 1000000000, 10, 1);
+        *p++ = '.';
+        p = fmtnum(p, e->ns / 1000 % 1000000, 10, 6);
+        *p++ = ' ';
+        len = strlen(name);
+        memcpy(p, name, len);
+        p += len;
+        memcpy(p, " 0x", 3);
+        p = fmtnum(p+3, e->window, 16, 1);
+        *p++ = ' ';
+        p = fmtnum(p, e->dur_ns, 10, 1);
+        memcpy(p, "ns\n", 3);
+        p += 3;
+
+        if(write(STDERR_FILENO, line, p - line) < 0)
+            return;
     }
 }
 
-// TODO: implement
-void quit()
+void drag_window(int force)
 {
-    /*Window root_return, parent;
-    Window *children;
-    int i;
-    unsigned int nchildren;
-    XEvent ev;
+    uint64_t now;
+    int w, h, dx = drag.rx - drag.px, dy = drag.ry - drag.py;
 
+    if(!drag.moved)
+        return;
 
-    if(bool_quit == 1) {
-        XUngrabKey(dis, AnyKey, AnyModifier, root);
-        XDestroySubwindows(dis, root);
-        fprintf(stdout, "catwm: Thanks for using!\n");
-        XCloseDisplay(dis);
-        die("forced shutdown");
+    // Too early for the next frame: come back when it's time
+    now = timestamp();
+    if(!force && now - drag.last_ns < drag.period_ns)
+    {
+        if(!drag.timer_armed)
+            arm_timer(TimerDrag, drag.period_ns - (now - drag.last_ns), 0);
+        drag.timer_armed = 1;
+        return;
     }
 
-    bool_quit = 1;
-    XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
-    for(i = 0; i < nchildren; i++) {
-        send_kill_signal(children[i]);
-    }
-    //keep alive until all windows are killed
-    while(nchildren > 0) {
-        XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
-        XNextEvent(dis,&ev);
-        if(events[ev.type])
-            events[ev.type](&ev);
+    if(drag.button == MOVE_BUTTON)
+        move_window(drag.c, drag.x+dx, drag.y+dy, drag.w, drag.h);
+    else
+    {
+        // Within what the client accepts, from its cached size hints
+        w = MAX(drag.w+dx, MAX(drag.c->min_w, MIN_SIZE));
+        h = MAX(drag.h+dy, MAX(drag.c->min_h, MIN_SIZE));
+        if(drag.c->max_w)
+            w = MIN(w, drag.c->max_w);
+        if(drag.c->max_h)
+            h = MIN(h, drag.c->max_h);
+        move_window(drag.c, drag.x, drag.y, w, h);
     }
 
-    XUngrabKey(dis,AnyKey,AnyModifier,root);
-    fprintf(stdout,"catwm: Thanks for using!\n");*/
+    drag.moved = 0;
+    drag.last_ns = now;
+    ++stats.drag_configures;
 }
 
-void remove_window(xcb_window_t w)
+void dumpstats()
 {
-    client *c;
+    int i, b;
+    unsigned long hits, misses;
+
+    fprintf(stderr, "catwm-xcb: %lu events, %lu batches, %lu requests (%.2f requests/event, %.2f events/batch)\n",
+            stats.events, stats.batches, stats.requests,
+            stats.events ? (double)stats.requests/stats.events : 0.0,
+            stats.batches ? (double)stats.events/stats.batches : 0.0);
+    fprintf(stderr, "catwm-xcb: %lu wakeups (%lu idle), %.2f wakeups/s over %.1f s\n",
+            stats.wakeups, stats.idle_wakeups, stats.wakeups/((timestamp() - start_ns)/1e9),
+            (timestamp() - start_ns)/1e9);
+    fprintf(stderr, "catwm-xcb: setup took %.1f us (%lu windows adopted, %lu restored), first event after %.1f us\n",
+            stats.setup_ns/1e3, stats.adopted, stats.restored, stats.first_event_ns/1e3);
+    for(i=0, hits=stats.layout_hits, misses=stats.layout_misses; i<ndesktops; ++i)
+    {
+        hits += desktops[i]->cache.hits;
+        misses += desktops[i]->cache.misses;
+    }
+    fprintf(stderr, "catwm-xcb: %d workspaces, %lu layouts computed, %lu reused\n", ndesktops, misses, hits);
+    fprintf(stderr, "catwm-xcb: %lu configure requests, %lu forwarded, %lu answered with the layout\n",
+            stats.configures, stats.configures_sent, stats.configures_synthetic);
+    fprintf(stderr, "catwm-xcb: %lu motion events, %lu drag configures\n", stats.motions, stats.drag_configures);
+    fprintf(stderr, "catwm-xcb: %lu desktop switches (%s%s), %.1f us average, %.1f us max, %.2f requests/switch\n",
+            stats.switches, HIDE_OFFSCREEN ? "offscreen" : "unmap", GRAB_ON_SWITCH ? ", grabbed" : "",
+            stats.switches ? stats.switch_ns/1e3/stats.switches : 0.0, stats.switch_max_ns/1e3,
+            stats.switches ? (double)stats.switch_requests/stats.switches : 0.0);
+
+    fprintf(stderr, "catwm-xcb: events:");
+    for(i=0; i<TABLENGTH(evcount); ++i)
+        if(evcount[i])
+        {
+            if(i < TABLENGTH(evnames))
+                fprintf(stderr, " %s %lu", evnames[i], evcount[i]);
+            else
+                fprintf(stderr, " #%d %lu", i, evcount[i]);
+        }
+    fprintf(stderr, "\n");
 
-    // CHANGE THIS UGLY CODE
-    for(c=head; c; c=c->next)
+    for(i=0; i<ProfLast; ++i)
     {
+        if(!prof[i].calls)
+            continue;
+
+        fprintf(stderr, "catwm-xcb: %-16s %8lu calls, %.2f us average, %.2f us max, %.2f requests/call\n",
+                profnames[i], prof[i].calls, prof[i].ns/1e3/prof[i].calls, prof[i].max_ns/1e3,
+                (double)prof[i].requests/prof[i].calls);
+
+        // Bucket b holds latencies in [2^b, 2^(b+1)) ns
+        fprintf(stderr, "catwm-xcb: %-16s", "");
+        for(b=0; b<HISTBUCKETS; ++b)
+            if(prof[i].hist[b])
+                fprintf(stderr, " %lluns:%lu", 1ULL << b, prof[i].hist[b]);
+        fprintf(stderr, "\n");
+    }
+}
 
-        if(c->window == w)
+void expire(int t)
+{
+    uint64_t n;
+
+    if(read(timerfd[t], &n, sizeof(n)) != sizeof(n))
+        return;
+
+    switch(t)
+    {
+        case TimerBatch:
+            batch_armed = 0;
+            batch_due = 1;
+            break;
+
+        case TimerStats:
+            defer(dumpstats);
+            break;
+
+        case TimerDrag:
+            drag.timer_armed = 0;
+            break;
+
+        case TimerKill:
+            kill_expired();
+            break;
+    }
+}
+
+int find_closing(xcb_window_t w)
+{
+    int i;
+
+    for(i=0; i<nclosing; ++i)
+        if(closing[i].window == w)
+            return i;
+
+    return -1;
+}
+
+// NULL when it isn't in use
+desktop *find_desktop(int id)
+{
+    int i = desktop_index(id);
+
+    return i < ndesktops && desktops[i]->id == id ? desktops[i] : NULL;
+}
+
+char *fmtnum(char *p, uint64_t v, int base, int width)
+{
+    char buf[24];
+    int n = 0;
+
+    do
+        buf[n++] = "0123456789abcdef"[v % base];
+    while((v /= base) || n < width);
+
+    while(n)
+        *p++ = buf[--n];
+
+    return p;
+}
+
+// Tiled windows are told where the layout put them with a synthetic
+// ConfigureNotify, the others get what they asked for
+void flush_configures()
+{
+    xcb_configure_notify_event_t ev;
+    uint32_t values[7];
+    client *c;
+    int i, j, n;
+
+    for(i=0; i<npending; ++i)
+    {
+        if((c = wintoclient(pending[i].window)) && !c->floating)
+        {
+            // Not laid out yet, the layout will configure it for real
+            if(c->w < 0)
+                continue;
+
+            memset(&ev, 0, sizeof(ev));
+            ev.response_type = XCB_CONFIGURE_NOTIFY;
+            ev.event = ev.window = c->window;
+            ev.above_sibling = XCB_NONE;
+            ev.x = c->x;
+            ev.y = c->y;
+            ev.width = c->w;
+            ev.height = c->h;
+            ev.border_width = c->bw;
+            REQ(xcb_send_event(connection, 0, c->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&ev));
+            ++stats.configures_synthetic;
+            continue;
+        }
+
+        // A floating window stands where it asked to be
+        if(c)
+        {
+            if(pending[i].mask & XCB_CONFIG_WINDOW_X)
+                c->x = pending[i].values[0];
+            if(pending[i].mask & XCB_CONFIG_WINDOW_Y)
+                c->y = pending[i].values[1];
+            if(pending[i].mask & XCB_CONFIG_WINDOW_WIDTH)
+                c->w = pending[i].values[2];
+            if(pending[i].mask & XCB_CONFIG_WINDOW_HEIGHT)
+                c->h = pending[i].values[3];
+            if(pending[i].mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+                c->bw = pending[i].values[4];
+        }
+
+        for(j=n=0; j<TABLENGTH(values); ++j)
+            if(pending[i].mask & (1 << j))
+                values[n++] = pending[i].values[j];
+
+        REQ(xcb_configure_window(connection, pending[i].window, pending[i].mask, values));
+        ++stats.configures_sent;
+    }
+
+    for(i=0; i<npending; ++i)
+        pendingtable[winhash(pending[i].window)] = 0;
+    npending = 0;
+}
+
+void free_client(client *c)
+{
+    c->hnext = pool;
+    pool = c;
+}
+
+// WM_CLASS is the instance then the class, both NUL terminated
+void get_class(xcb_window_t w, void *reply)
+{
+    xcb_get_property_reply_t *r = reply;
+    client *c;
+    const char *v;
+    int len, n;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    c->instance[0] = c->class[0] = '\0';
+    if(!r || r->format != 8)
+        return;
+
+    v = xcb_get_property_value(r);
+    len = xcb_get_property_value_length(r);
+    n = strnlen(v, len);
+    snprintf(c->instance, sizeof(c->instance), "%.*s", n, v);
+    if(n < len)
+        snprintf(c->class, sizeof(c->class), "%.*s", (int)strnlen(v+n+1, len-n-1), v+n+1);
+}
+
+// The workspace, created empty if it isn't in use
+desktop *get_desktop(int id)
+{
+    desktop *d;
+    int i = desktop_index(id);
+
+    if(i < ndesktops && desktops[i]->id == id)
+        return desktops[i];
+
+    if(ndesktops == desktops_size)
+    {
+        desktops_size = desktops_size ? 2*desktops_size : 16;
+        if(!(desktops = realloc(desktops, desktops_size*sizeof(desktop*))))
+            die("realloc failed !");
+    }
+
+    if(!(d = calloc(1, sizeof(desktop))))
+        die("calloc failed !");
+    d->id = id;
+    d->mon = -1;
+
+    memmove(&desktops[i+1], &desktops[i], (ndesktops++ - i)*sizeof(desktop*));
+    desktops[i] = d;
+
+    return d;
+}
+
+void get_hints(xcb_window_t w, void *reply)
+{
+    xcb_get_property_reply_t *r = reply;
+    client *c;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    c->urgent = 0;
+    if(!r || r->format != 32 || xcb_get_property_value_length(r) < 4)
+        return;
+
+    c->urgent = !!(((uint32_t*)xcb_get_property_value(r))[0] & XCB_ICCCM_WM_HINT_X_URGENCY);
+}
+
+void get_name(xcb_window_t w, void *reply)
+{
+    xcb_get_property_reply_t *r = reply;
+    client *c;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    c->name[0] = '\0';
+    if(r && r->format == 8)
+        snprintf(c->name, sizeof(c->name), "%.*s", xcb_get_property_value_length(r), (char*)xcb_get_property_value(r));
+}
+
+// Only the size limits are kept: flags, pad[4], min, max...
+void get_normal_hints(xcb_window_t w, void *reply)
+{
+    xcb_get_property_reply_t *r = reply;
+    uint32_t *v;
+    client *c;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    c->min_w = c->min_h = c->max_w = c->max_h = 0;
+    if(!r || r->format != 32 || xcb_get_property_value_length(r) < 9*4)
+        return;
+
+    v = xcb_get_property_value(r);
+    if(v[0] & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
+    {
+        c->min_w = v[5];
+        c->min_h = v[6];
+    }
+    if(v[0] & XCB_ICCCM_SIZE_HINT_P_MAX_SIZE)
+    {
+        c->max_w = v[7];
+        c->max_h = v[8];
+    }
+}
+
+void get_protocols(xcb_window_t w, void *reply)
+{
+    xcb_get_property_reply_t *r = reply;
+    xcb_atom_t *atoms;
+    client *c;
+    int i, n;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    c->protocols = 0;
+    if(!r || r->type != XCB_ATOM_ATOM || r->format != 32)
+        return;
+
+    atoms = xcb_get_property_value(r);
+    n = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
+    for(i=0; i<n; ++i)
+        if(atoms[i] == wmatom[WMDeleteWindow])
+            c->protocols |= ProtoDelete;
+        else if(atoms[i] == wmatom[NetWMPing])
+            c->protocols |= ProtoPing;
+}
+
+void get_property(xcb_window_t w, int p)
+{
+    wait_reply(REQ(xcb_get_property(connection, 0, w, properties[p].atom, XCB_GET_PROPERTY_TYPE_ANY, 0, properties[p].length)),
+               w, properties[p].handler);
+}
+
+// Thanks monsterwm
+static unsigned int get_colorpixel(const char *hex)
+{
+    char strgroups[3][3]  = {{hex[1], hex[2], '\0'}, {hex[3], hex[4], '\0'}, {hex[5], hex[6], '\0'}};
+    unsigned int rgb16[3] = {(strtol(strgroups[0], NULL, 16)), (strtol(strgroups[1], NULL, 16)), (strtol(strgroups[2], NULL, 16))};
+    return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
+}
+
+// ras, split in two so that the replies can be collected later
+xcb_alloc_color_cookie_t alloc_color(const char* color)
+{
+    unsigned long rgb = get_colorpixel(color);
+
+    return xcb_alloc_color(connection, screen->default_colormap, (rgb >> 16) * 257, (rgb >> 8 & 255) * 257, (rgb & 255) * 257);
+}
+
+unsigned long get_color(xcb_alloc_color_cookie_t cookie, const char* color)
+{
+    xcb_alloc_color_reply_t *c;
+    unsigned long pixel;
+
+    if (!(c = xcb_alloc_color_reply(connection, cookie, NULL)))
+        die("cannot allocate color '%s'", color);
+
+    pixel = c->pixel;
+    free(c);
+    return pixel;
+}
+
+// Grab every shortcut, whatever the state of NumLock and CapsLock, and
+// index them by keycode for keypress()
+void grabkeys()
+{
+    int i, j;
+    xcb_keycode_t *codes, *code;
+    const uint16_t locks[] = {0, XCB_MOD_MASK_LOCK, numlockmask, numlockmask | XCB_MOD_MASK_LOCK};
+
+    REQ(xcb_ungrab_key(connection, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY));
+
+    memset(keyhead, 0, sizeof(keyhead));
+    nkeybinds = 0;
+
+    // For every shortcuts
+    for(i=0; i<TABLENGTH(keys); ++i)
+    {
+        if(!(codes = xcb_key_symbols_get_keycode(keysyms, keys[i].keysym)))
+            continue;
+
+        for(code = codes; *code != XCB_NO_SYMBOL; ++code)
+        {
+            for(j=0; j<(numlockmask ? 4 : 2); ++j)
+                REQ(xcb_grab_key(connection, 1, screen->root, keys[i].mod | locks[j], *code, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC));
+
+            if(nkeybinds == keybinds_size)
+            {
+                keybinds_size = keybinds_size ? 2*keybinds_size : TABLENGTH(keys);
+                if(!(keybinds = realloc(keybinds, keybinds_size*sizeof(keybind))))
+                    die("realloc failed !");
+            }
+
+            keybinds[nkeybinds].key = &keys[i];
+            keybinds[nkeybinds].next = keyhead[*code];
+            keyhead[*code] = ++nkeybinds;
+        }
+
+        free(codes);
+    }
+
+    // And the buttons dragging windows, motion comes with them
+    REQ(xcb_ungrab_button(connection, XCB_BUTTON_INDEX_ANY, screen->root, XCB_MOD_MASK_ANY));
+    for(j=0; j<(numlockmask ? 4 : 2); ++j)
+    {
+        REQ(xcb_grab_button(connection, 0, screen->root, XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+                            XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE, MOVE_BUTTON, MOD | locks[j]));
+        REQ(xcb_grab_button(connection, 0, screen->root, XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+                            XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE, RESIZE_BUTTON, MOD | locks[j]));
+    }
+}
+
+void handle_event(xcb_generic_event_t *ge)
+{
+    uint64_t t = TRACING(TRACE_EVENT) ? timestamp() : 0;
+    xcb_window_t w = XCB_NONE;
+
+    ++evcount[ge->response_type & 0x7f];
+
+    switch(ge->response_type & ~0x80)
+    {
+        case XCB_KEY_PRESS:
+            PROFILE(ProfKeyPress, keypress((xcb_key_press_event_t*)ge));
+            break;
+
+        case XCB_MAPPING_NOTIFY:
+            mappingnotify((xcb_mapping_notify_event_t*)ge);
+            break;
+
+        case XCB_BUTTON_PRESS:
+            w = ((xcb_button_press_event_t*)ge)->child;
+            buttonpress((xcb_button_press_event_t*)ge);
+            break;
+
+        case XCB_BUTTON_RELEASE:
+            buttonrelease((xcb_button_release_event_t*)ge);
+            break;
+
+        case XCB_MOTION_NOTIFY:
+            motionnotify((xcb_motion_notify_event_t*)ge);
+            break;
+
+        case XCB_PROPERTY_NOTIFY:
+            w = ((xcb_property_notify_event_t*)ge)->window;
+            propertynotify((xcb_property_notify_event_t*)ge);
+            break;
+
+        case XCB_CLIENT_MESSAGE:
+            w = ((xcb_client_message_event_t*)ge)->window;
+            clientmessage((xcb_client_message_event_t*)ge);
+            break;
+
+        case XCB_MAP_REQUEST:
+            w = ((xcb_map_request_event_t*)ge)->window;
+            PROFILE(ProfMapRequest, maprequest((xcb_map_request_event_t*)ge));
+            break;
+
+        case XCB_DESTROY_NOTIFY:
+            w = ((xcb_destroy_notify_event_t*)ge)->window;
+            PROFILE(ProfDestroyNotify, destroynotify((xcb_destroy_notify_event_t*)ge));
+            break;
+
+        case XCB_CONFIGURE_NOTIFY:
+            w = ((xcb_configure_notify_event_t*)ge)->window;
+            configurenotify((xcb_configure_notify_event_t*)ge);
+            break;
+
+        case XCB_CONFIGURE_REQUEST:
+            w = ((xcb_configure_request_event_t*)ge)->window;
+            PROFILE(ProfConfigureRequest, configurerequest((xcb_configure_request_event_t*)ge));
+            break;
+
+        // A window that went away while nobody was managing it (we were
+        // restarting) only shows up as an error on our first request to it
+        case 0:
+            if(((xcb_generic_error_t*)ge)->error_code == XCB_WINDOW)
+            {
+                xcb_destroy_notify_event_t e = { .window = ((xcb_window_error_t*)ge)->bad_value };
+                w = e.window;
+                destroynotify(&e);
+            }
+            break;
+
+        default:
+            // Outputs change in bursts, read them back once per batch
+            if(randr_base >= 0 && (ge->response_type & 0x7f) >= randr_base && (ge->response_type & 0x7f) <= randr_base + XCB_RANDR_NOTIFY)
+                defer(randrnotify);
+            break;
+    }
+
+    TRACE(TRACE_EVENT, ge->response_type & 0x7f, w, t);
+}
+
+void handle_signals()
+{
+    struct signalfd_siginfo si;
+
+    while(read(sigfd, &si, sizeof(si)) == sizeof(si))
+        switch(si.ssi_signo)
+        {
+            case SIGCHLD:
+                while(0 < waitpid(-1, NULL, WNOHANG));
+                break;
+
+            case SIGUSR1:
+                defer(dumpstats);
+                break;
+
+            case SIGUSR2:
+                defer(dump_trace);
+                break;
+
+            case SIGINT:
+            case SIGTERM:
+                quit();
+                break;
+        }
+}
+
+void hide_client(client *c, int how)
+{
+    const uint32_t values[] = {-2*sw};
+
+    // An unmapped window is as hidden as it gets
+    if(c->hidden == how || c->hidden == Unmapped)
+        return;
+
+    if(how == Unmapped)
+    {
+        REQ(xcb_unmap_window(connection, c->window));
+        set_wm_state(c, XCB_ICCCM_WM_STATE_ICONIC);
+    }
+    // Moved out of sight: the window keeps its contents and won't repaint when back
+    else if(c->hidden == Shown)
+        REQ(xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_X, values));
+
+    c->hidden = how;
+}
+
+void increase()
+{
+    if(master_size < monitors[selmon].w-50)
+    {
+        master_size += 10;
+        dirty |= DIRTY_LAYOUT;
+    }
+}
+
+// Let wintoclient() find the client
+void index_client(client *c)
+{
+    unsigned int h = winhash(c->window);
+
+    c->hnext = wintable[h];
+    wintable[h] = c;
+}
+
+// Force the next layout to send the whole geometry
+void invalidate_geometry(client *c)
+{
+    c->x = c->y = c->w = c->h = c->bw = -1;
+}
+
+void keypress(xcb_key_press_event_t *e)
+{
+    int i;
+    uint16_t state = CLEANMASK(e->state);
+    const struct key *k;
+
+    for(i=keyhead[e->detail]; i; i=keybinds[i-1].next)
+    {
+        k = keybinds[i-1].key;
+        if(CLEANMASK(k->mod) == state)
+            k->function(k->arg);
+    }
+}
+
+void launch(const char **argv)
+{
+    pid_t pid;
+    sigset_t none, dfl;
+    posix_spawnattr_t attr;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+    // Children must not inherit our blocked signals, nor the SIGCHLD the
+    // helper ignores: shells and terminals wait for their own children
+    sigemptyset(&none);
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+#ifdef POSIX_SPAWN_SETSID
+    flags |= POSIX_SPAWN_SETSID;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    if(posix_spawnp(&pid, argv[0], NULL, &attr, (char**)argv, environ))
+        fprintf(stderr, "catwm-xcb: cannot spawn %s\n", argv[0]);
+
+    posix_spawnattr_destroy(&attr);
+}
+
+xcb_atom_t get_intern_atom(xcb_intern_atom_cookie_t cookie, const char *name)
+{
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(connection, cookie, NULL);
+
+    if(!reply)
+        die("couldn't retrieve atom %s", name);
+
+    xcb_atom_t ret = reply->atom;
+
+    free(reply);
+    return ret;
+}
+
+// Close the focused window the ICCCM way: a WM_DELETE_WINDOW message when
+// the client takes part in it (or hasn't told us yet). A client that
+// answers _NET_WM_PING is pinged too, and killed if it doesn't within
+// KILL_TIMEOUT: it hangs. Otherwise it may take its time (to ask about
+// unsaved work, say), only a second call kills it. Clients without the
+// protocol, or too many closing at once, are killed right away.
+void kill_client()
+{
+    uint64_t now;
+    int i;
+
+    if(current == NULL)
+        return;
+
+    now = timestamp();
+    if((i = find_closing(current->window)) >= 0 || !(current->protocols & ProtoDelete) || nclosing == TABLENGTH(closing))
+    {
+        if(i >= 0)
+            closing[i] = closing[--nclosing];
+        REQ(xcb_kill_client(connection, current->window));
+        TRACE(TRACE_INFO, TraceKill, current->window, now);
+        TRACE(TRACE_INFO, TraceKill, current->window, now);
+        return;
+    }
+
+    send_protocol(current->window, wmatom[WMDeleteWindow]);
+    closing[nclosing].window = current->window;
+    closing[nclosing].deadline = 0;
+    TRACE(TRACE_INFO, TraceClose, current->window, now);
+
+    if(current->protocols != -1 && current->protocols & ProtoPing)
+    {
+        send_protocol(current->window, wmatom[NetWMPing]);
+        closing[nclosing].deadline = now + KILL_TIMEOUT * 1000000ULL;
+
+        // Every ping has the same timeout, a running timer is due first
+        for(i=0; i<nclosing && !closing[i].deadline; ++i);
+        if(i == nclosing)
+            arm_timer(TimerKill, KILL_TIMEOUT * 1000000ULL, 0);
+    }
+    ++nclosing;
+}
+
+void kill_expired()
+{
+    uint64_t now = timestamp(), next = 0;
+    int i;
+
+    // remove_window() drops the ones that closed, all are still managed
+    for(i=0; i<nclosing; )
+        if(closing[i].deadline && closing[i].deadline <= now)
+        {
+            REQ(xcb_kill_client(connection, closing[i].window));
+            TRACE(TRACE_INFO, TraceKill, closing[i].window, now);
+            closing[i] = closing[--nclosing];
+        }
+        else
+        {
+            if(closing[i].deadline && (!next || closing[i].deadline < next))
+                next = closing[i].deadline;
+            ++i;
+        }
+
+    if(next)
+        arm_timer(TimerKill, next - now, 0);
+}
+
+// The keyboard was remapped (xmodmap, setxkbmap...): shortcuts may now
+// live on other keycodes and NumLock on another modifier
+void mappingnotify(xcb_mapping_notify_event_t *e)
+{
+    if(e->request == XCB_MAPPING_POINTER)
+        return;
+
+    xcb_refresh_keyboard_mapping(keysyms, e);
+    update_numlockmask(xcb_get_modifier_mapping(connection));
+    grabkeys();
+}
+
+void maprequest(xcb_map_request_event_t *e)
+{
+    client *c;
+
+    // In case the client has already made a map request but yields another one later on.
+    // Hidden windows get mapped when we switch back to them.
+    if((c = wintoclient(e->window)))
+    {
+        if(get_desktop(c->desktop)->mon >= 0 && !c->hidden)
+            REQ(xcb_map_window(connection, e->window));
+        return;
+    }
+
+    // Otherwise, it is the first time we hear about it.
+    add_window(e->window);
+    REQ(xcb_map_window(connection, e->window));
+    set_wm_state(current, XCB_ICCCM_WM_STATE_NORMAL);
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
+
+void move_down()
+{
+    if(current == NULL || current->pos == nclients-1 || current->pos == 0)
+    {
+        return;
+    }
+    //keep the moved window activated
+    swap(current, clients[current->pos+1]);
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
+
+void move_up()
+{
+    if(current == NULL || current->pos <= 1)
+        return;
+
+    swap(clients[current->pos-1], current);
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
+
+void next_desktop()
+{
+    step_desktop(1);
+}
+
+void next_monitor()
+{
+    Arg a = {.i = monitors[(selmon+1) % nmonitors].desktop};
+    change_desktop(a);
+}
+
+void next_win()
+{
+    if(current != NULL)
+    {
+        current = clients[(current->pos+1) % nclients];
+        dirty |= DIRTY_FOCUS;
+    }
+}
+
+// Hand over the replies that came in, they arrive in request order
+void poll_replies()
+{
+    struct reply_wait *w;
+    void *reply;
+    xcb_generic_error_t *error;
+
+    for(; waits_head < nwaits; ++waits_head)
+    {
+        w = &waits[waits_head];
+        reply = NULL;
+        error = NULL;
+
+        if(!xcb_poll_for_reply(connection, w->sequence, &reply, &error))
+            break;
+
+        w->handler(w->window, reply);
+        free(reply);
+        free(error);
+    }
+
+    if(waits_head == nwaits)
+        waits_head = nwaits = 0;
+}
+
+void prev_desktop()
+{
+    step_desktop(-1);
+}
+
+void prev_win()
+{
+    if(current != NULL)
+    {
+        current = clients[(current->pos+nclients-1) % nclients];
+        dirty |= DIRTY_FOCUS;
+    }
+}
+
+void profile(int p, uint64_t t, unsigned int seq)
+{
+    uint64_t dt = timestamp() - t;
+    int b = dt ? 63 - __builtin_clzll(dt) : 0;
+
+    ++prof[p].calls;
+    prof[p].requests += last_seq - seq;
+    prof[p].ns += dt;
+    if(dt > prof[p].max_ns)
+        prof[p].max_ns = dt;
+    ++prof[p].hist[b < HISTBUCKETS ? b : HISTBUCKETS-1];
+}
+
+// Only the property that changed is fetched again, a deleted one is just
+// forgotten
+void propertynotify(xcb_property_notify_event_t *e)
+{
+    int p;
+
+    for(p=0; p<PropLast && properties[p].atom != e->atom; ++p);
+
+    if(p == PropLast || !wintoclient(e->window))
+        return;
+
+    if(e->state == XCB_PROPERTY_DELETE)
+        properties[p].handler(e->window, NULL);
+    else
+        get_property(e->window, p);
+}
+
+void quit()
+{
+    bool_quit = 1;
+}
+
+void randrnotify()
+{
+    update_monitors(xcb_randr_get_screen_resources_current(connection, screen->root));
+}
+
+// A string of the restart state, the part that doesn't fit is skipped
+int read_string(FILE *f, char *s, int size, int len)
+{
+    int n = MIN(len, size-1);
+
+    s[n] = '\0';
+    return fread(s, 1, n, f) == n && fseek(f, len - n, SEEK_CUR) == 0;
+}
+
+// Free a workspace nobody needs anymore: no window, not shown, not selected
+void release_desktop(int id)
+{
+    desktop *d;
+    int i = desktop_index(id);
+
+    if(i == ndesktops || (d = desktops[i])->id != id || d->nclients || d->mon >= 0 || id == current_desktop)
+        return;
+
+    stats.layout_hits += d->cache.hits;
+    stats.layout_misses += d->cache.misses;
+    free(d->cache.g);
+    free(d->clients);
+    free(d);
+
+    memmove(&desktops[i], &desktops[i+1], (--ndesktops - i)*sizeof(desktop*));
+}
+
+void remove_window(xcb_window_t w)
+{
+    client *c, **p;
+    int i, tmp = current_desktop;
+
+    if(!(c = wintoclient(w)))
+        return;
+
+    // Drop it from the index
+    for(p = &wintable[winhash(w)]; *p != c; p = &(*p)->hnext);
+    *p = c->hnext;
+
+    // Its id may be reused, a new window must not inherit the kill
+    if((i = find_closing(w)) >= 0)
+        closing[i] = closing[--nclosing];
+
+    // A property can't lose an element in the middle, the list is written
+    // again once for the whole batch
+    // A restored window may be missing from it
+    for(i=0; i<nnetclients && netclients[i] != w; ++i);
+    if(i < nnetclients)
+    {
+        memmove(&netclients[i], &netclients[i+1], (--nnetclients - i)*sizeof(xcb_window_t));
+        dirty |= DIRTY_CLIENTS;
+    }
+
+    // The window may live on another desktop
+    if(c->desktop != tmp)
+    {
+        save_desktop(tmp);
+        select_desktop(c->desktop);
+    }
+
+    detach(c);
+
+    if(focused == c)
+        focused = NULL;
+
+    if(drag.c == c)
+        drag.c = NULL;
+
+    if(c->desktop != tmp)
+    {
+        save_desktop(c->desktop);
+        select_desktop(tmp);
+        release_desktop(c->desktop);
+    }
+
+    free_client(c);
+}
+
+// Serialize the state and exec ourselves again once the loop is left
+void restart()
+{
+    bool_restart = 1;
+    bool_quit = 1;
+}
+
+// Rebuild the desktops saved by the instance we replaced. Everything we knew
+// about the windows comes back from the state, the server is only asked to
+// send us their property changes again.
+void restore_state()
+{
+    struct state_header h;
+    struct state_monitor m;
+    struct state_desktop sd;
+    struct state_client sc;
+    const char *env = getenv("CATWM_STATE");
+    desktop *dk;
+    client *c;
+    FILE *f;
+    int i, j, d, k, n, fd, cut = 0;
+    const uint32_t values[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+
+    if(!env)
+        return;
+
+    // Not for the programs we spawn
+    fd = atoi(env);
+    unsetenv("CATWM_STATE");
+    if(!(f = fdopen(fd, "r")))
+    {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    rewind(f);
+
+    if(fread(&h, sizeof(h), 1, f) != 1 || h.magic != STATE_MAGIC || h.version != STATE_VERSION ||
+       h.ndesktops < 0 || h.nmonitors < 0 || h.nclients < 0)
+    {
+        fprintf(stderr, "catwm-xcb: ignoring restart state from another version\n");
+        fclose(f);
+        return;
+    }
+
+    save_desktop(current_desktop);
+
+    // Monitors get their desktops back, the one another monitor took is
+    // exchanged with it
+    for(i=0; i<h.nmonitors && fread(&m, sizeof(m), 1, f) == 1; ++i)
+    {
+        for(j=0; j<nmonitors && monitors[j].crtc != m.crtc; ++j);
+
+        if(j == nmonitors || m.desktop < 0 || (d = monitors[j].desktop) == m.desktop)
+            continue;
+
+        dk = get_desktop(m.desktop);
+        if((k = dk->mon) >= 0)
+            monitors[k].desktop = d;
+        get_desktop(d)->mon = k;
+
+        monitors[j].desktop = m.desktop;
+        dk->mon = j;
+    }
+
+    for(i=0; i<nmonitors; ++i)
+        if(monitors[i].crtc == h.selcrtc)
+            selmon = i;
+
+    // The client list is written back whole, in the order it had
+    if(h.nclients > netclients_size)
+    {
+        netclients_size = h.nclients;
+        if(!(netclients = realloc(netclients, netclients_size*sizeof(xcb_window_t))))
+            die("realloc failed !");
+    }
+    nnetclients = h.nclients;
+    memset(netclients, 0, nnetclients*sizeof(xcb_window_t));
+
+    for(n=0; n<h.ndesktops && !cut && fread(&sd, sizeof(sd), 1, f) == 1 && sd.id >= 0 && sd.id < MAX_DESKTOPS; ++n)
+    {
+        d = sd.id;
+        select_desktop(d);
+        master_size = sd.master_size;
+        mode = sd.mode >= 0 && sd.mode < nlayouts ? sd.mode : 0;
+
+        for(i=0; i<sd.nclients && fread(&sc, sizeof(sc), 1, f) == 1; ++i)
+        {
+            c = alloc_client();
+            c->window = sc.window;
+            c->desktop = d;
+            c->x = sc.x;
+            c->y = sc.y;
+            c->w = sc.w;
+            c->h = sc.h;
+            c->bw = sc.bw;
+            c->hidden = sc.hidden;
+            c->floating = sc.floating;
+            c->protocols = sc.protocols;
+            c->min_w = sc.min_w;
+            c->min_h = sc.min_h;
+            c->max_w = sc.max_w;
+            c->max_h = sc.max_h;
+            c->urgent = sc.urgent;
+
+            // Truncated: keep what came before, the rest is out of step
+            if(!read_string(f, c->name, sizeof(c->name), sc.name_len) ||
+               !read_string(f, c->instance, sizeof(c->instance), sc.instance_len) ||
+               !read_string(f, c->class, sizeof(c->class), sc.class_len))
+            {
+                fprintf(stderr, "catwm-xcb: restart state cut short\n");
+                free_client(c);
+                cut = 1;
+                break;
+            }
+            attach(c);
+            index_client(c);
+
+            if(sc.order < nnetclients)
+                netclients[sc.order] = c->window;
+
+            REQ(xcb_change_window_attributes(connection, c->window, XCB_CW_EVENT_MASK, values));
+            ++stats.restored;
+        }
+
+        current = sd.current >= 0 && sd.current < nclients ? clients[sd.current] : NULL;
+        save_desktop(d);
+
+        // Shown before, hidden now that its monitor is gone
+        if(get_desktop(d)->mon < 0)
+            for(i=0; i<nclients; ++i)
+                hide_client(clients[i], DESKTOP_HIDE);
+    }
+
+    fclose(f);
+
+    // Holes left by a truncated state
+    for(i=j=0; i<nnetclients; ++i)
+        if(netclients[i])
+            netclients[j++] = netclients[i];
+    nnetclients = j;
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetClientList], XCB_ATOM_WINDOW, 32, nnetclients, netclients));
+
+    select_desktop(monitors[selmon].desktop);
+    for(i=0; i<nmonitors; ++i)
+        monitors[i].dirty = 1;
+
+    // Desktops the monitors showed before we got theirs back
+    for(i=ndesktops-1; i>=0; --i)
+        release_desktop(desktops[i]->id);
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
+
+void run_deferred()
+{
+    int i;
+
+    // Deferred work may defer more, it still runs in this batch
+    for(i=0; i<ndeferred; ++i)
+        deferred[i]();
+
+    ndeferred = 0;
+}
+
+void save_desktop(int i)
+{
+    desktop *d = get_desktop(i);
+
+    d->master_size = master_size;
+    d->mode = mode;
+    d->clients = clients;
+    d->nclients = nclients;
+    d->size = clients_size;
+    d->current = current;
+}
+
+// Write what restore_state() needs into a memfd that stays open across
+// exec, -1 if we can't
+int save_state()
+{
+    struct state_header h = { STATE_MAGIC, STATE_VERSION, ndesktops, nmonitors, nnetclients, monitors[selmon].crtc };
+    struct state_monitor m;
+    struct state_desktop sd;
+    struct state_client sc;
+    desktop *dk;
+    client *c;
+    FILE *f;
+    int i, j, d, fd;
+
+    if((fd = memfd_create("catwm-xcb-state", 0)) < 0 || !(f = fdopen(dup(fd), "w")))
+    {
+        fprintf(stderr, "catwm-xcb: cannot save state, restarting without it\n");
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    save_desktop(current_desktop);
+
+    fwrite(&h, sizeof(h), 1, f);
+
+    for(i=0; i<nmonitors; ++i)
+    {
+        m = (struct state_monitor){ monitors[i].crtc, monitors[i].desktop };
+        fwrite(&m, sizeof(m), 1, f);
+    }
+
+    for(d=0; d<ndesktops; ++d)
+    {
+        dk = desktops[d];
+        sd = (struct state_desktop){ dk->id, dk->master_size, dk->mode, dk->nclients, dk->current ? dk->current->pos : -1 };
+        fwrite(&sd, sizeof(sd), 1, f);
+
+        for(i=0; i<dk->nclients; ++i)
+        {
+            c = dk->clients[i];
+            for(j=0; j<nnetclients && netclients[j] != c->window; ++j);
+
+            sc = (struct state_client){
+                .window = c->window, .order = j,
+                .x = c->x, .y = c->y, .w = c->w, .h = c->h, .bw = c->bw,
+                .min_w = c->min_w, .min_h = c->min_h, .max_w = c->max_w, .max_h = c->max_h,
+                .protocols = c->protocols, .hidden = c->hidden, .floating = c->floating, .urgent = c->urgent,
+                .name_len = strlen(c->name), .instance_len = strlen(c->instance), .class_len = strlen(c->class),
+            };
+            fwrite(&sc, sizeof(sc), 1, f);
+            fwrite(c->name, 1, sc.name_len, f);
+            fwrite(c->instance, 1, sc.instance_len, f);
+            fwrite(c->class, 1, sc.class_len, f);
+        }
+    }
+
+    if(fclose(f) != 0)
+    {
+        fprintf(stderr, "catwm-xcb: cannot save state, restarting without it\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Manage the windows already there when we start. Everything we need to
+// know about them is asked at once, then the replies are collected.
+void scan(xcb_query_tree_cookie_t cookie)
+{
+    enum { Viewable = 1, Iconic = 2, Transient = 4 };
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    xcb_get_window_attributes_cookie_t *attrs;
+    xcb_get_property_cookie_t *states, *transients;
+    xcb_get_window_attributes_reply_t *attr;
+    xcb_get_property_reply_t *state, *transient;
+    unsigned char *kind;
+    int i, n, pass;
+
+    if(!(tree = xcb_query_tree_reply(connection, cookie, NULL)))
+        return;
+
+    children = xcb_query_tree_children(tree);
+    n = xcb_query_tree_children_length(tree);
+
+    attrs = malloc(n*sizeof(*attrs));
+    states = malloc(n*sizeof(*states));
+    transients = malloc(n*sizeof(*transients));
+    kind = malloc(n);
+    if(n && (!attrs || !states || !transients || !kind))
+        die("malloc failed !");
+
+    for(i=0; i<n; ++i)
+    {
+        // Windows we got back across a restart are known already
+        if(wintoclient(children[i]))
+            continue;
+
+        attrs[i] = xcb_get_window_attributes(connection, children[i]);
+        states[i] = xcb_get_property(connection, 0, children[i], wmatom[WMState], wmatom[WMState], 0, 2);
+        transients[i] = xcb_get_property(connection, 0, children[i], XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, 0, 1);
+    }
+
+    // Mapped windows, and the ones a WM iconified (maybe us before a restart)
+    for(i=0; i<n; ++i)
+    {
+        kind[i] = 0;
+        if(wintoclient(children[i]))
+            continue;
+
+        attr = xcb_get_window_attributes_reply(connection, attrs[i], NULL);
+        state = xcb_get_property_reply(connection, states[i], NULL);
+        transient = xcb_get_property_reply(connection, transients[i], NULL);
+
+        if(attr && !attr->override_redirect)
         {
-            if(c->prev == NULL && c->next == NULL)
+            if(attr->map_state == XCB_MAP_STATE_VIEWABLE)
+                kind[i] = Viewable;
+            else if(state && xcb_get_property_value_length(state) >= 4 && *(uint32_t*)xcb_get_property_value(state) == XCB_ICCCM_WM_STATE_ICONIC)
+                kind[i] = Iconic;
+
+            if(kind[i] && transient && xcb_get_property_value_length(transient) >= 4)
+                kind[i] |= Transient;
+        }
+
+        free(attr);
+        free(state);
+        free(transient);
+    }
+
+    // Transients come after the windows they belong to, all of them are
+    // laid out by the first commit
+    for(pass=0; pass<2; ++pass)
+        for(i=0; i<n; ++i)
+            if(kind[i] && !(kind[i] & Transient) == !pass)
             {
-                free(head);
-                head = NULL;
-                current = NULL;
-                return;
+                add_window(children[i]);
+                if(kind[i] & Iconic)
+                    current->hidden = Unmapped;
+                else
+                    set_wm_state(current, XCB_ICCCM_WM_STATE_NORMAL);
+                ++stats.adopted;
             }
 
-            if(c->prev == NULL)
-            {
-                head = c->next;
-                c->next->prev = NULL;
-                current = c->next;
-            }
-            else if(c->next == NULL)
+    if(stats.adopted)
+        dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+
+    free(attrs);
+    free(states);
+    free(transients);
+    free(kind);
+    free(tree);
+}
+
+void select_desktop(int i)
+{
+    desktop *d = get_desktop(i);
+
+    clients = d->clients;
+    nclients = d->nclients;
+    clients_size = d->size;
+    current = d->current;
+    master_size = d->master_size;
+    mode = d->mode;
+    current_desktop = i;
+}
+
+// posix_spawn() doesn't copy our page tables like fork() did. Children
+// are reaped through the signalfd.
+void spawn(const Arg arg)
+{
+    uint64_t t = timestamp();
+
+    // The helper is a fork of ours, the command lives at the same address
+    // there. A dead helper must not take us with it (no SIGPIPE): we launch
+    // ourselves from then on.
+    if(helperfd >= 0 && send(helperfd, &arg.com, sizeof(arg.com), MSG_NOSIGNAL) != sizeof(arg.com))
+    {
+        fprintf(stderr, "catwm-xcb: cannot reach the spawn helper\n");
+        close(helperfd);
+        helperfd = -1;
+    }
+
+    // Only timed when we launch: the helper never tells us when it is done
+    if(helperfd < 0)
+    {
+        launch(arg.com);
+        profile(ProfSpawn, t, last_seq);
+    }
+    TRACE(TRACE_INFO, TraceSpawn, XCB_NONE, t);
+}
+
+// Optional process that spawns on our behalf. It is forked right after
+// setup, its address space stays small however much ours grows.
+void start_helper()
+{
+    int sv[2];
+    const char **argv;
+    sigset_t none;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return;
+
+    switch(fork())
+    {
+        case -1:
+            close(sv[0]);
+            close(sv[1]);
+            return;
+
+        case 0:
+            close(sv[0]);
+            close(xcb_get_file_descriptor(connection));
+            if(ctlfd >= 0)
+                close(ctlfd);
+            close(sigfd);
+
+            // Let the kernel reap our children
+            signal(SIGCHLD, SIG_IGN);
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+
+            while(read(sv[1], &argv, sizeof(argv)) == sizeof(argv))
+                launch(argv);
+            _exit(EXIT_SUCCESS);
+
+        default:
+            close(sv[1]);
+            helperfd = sv[0];
+    }
+}
+
+void start()
+{
+    xcb_generic_event_t *ge = NULL;
+    struct epoll_event evs[8];
+    unsigned int seq;
+    int i, n = 0;
+
+    setup_loop();
+
+    // Lay out the monitors and windows setup found
+    commit();
+
+    // Main loop: sleep until the X connection, the control socket, a signal
+    // or a timer wakes us up, drain everything already queued, then relayout
+    // and flush once for the whole batch
+    while(!bool_quit)
+    {
+        // XCB may already hold events it read along with a reply
+        if(!(ge = xcb_poll_for_event(connection)))
+        {
+            if(xcb_connection_has_error(connection))
+                die("lost connection to the X server");
+
+            if((n = epoll_wait(epfd, evs, TABLENGTH(evs), -1)) < 0)
             {
-                c->prev->next = NULL;
-                current = c->prev;
+                if(errno != EINTR)
+                    die("epoll_wait failed !");
+                n = 0;
             }
-            else
+
+            ++stats.wakeups;
+            if(!(ge = xcb_poll_for_event(connection)))
+                ++stats.idle_wakeups;
+        }
+
+        if(ge && !stats.first_event_ns)
+            stats.first_event_ns = timestamp() - start_ns;
+
+        seq = last_seq;
+
+        for(i=0; i<n; ++i)
+            switch(evs[i].data.u32)
             {
-                c->prev->next = c->next;
-                c->next->prev = c->prev;
-                current = c->prev;
+                case WatchX:
+                    break;
+
+                case WatchControl:
+                    control();
+                    break;
+
+                case WatchSignal:
+                    handle_signals();
+                    break;
+
+                default:
+                    expire(evs[i].data.u32 - WatchTimer);
             }
+        n = 0;
 
-            free(c);
-            return;
+        for(; ge; ge = bool_quit ? NULL : xcb_poll_for_event(connection))
+        {
+            handle_event(ge);
+            free(ge);
+            ++stats.events;
+        }
+
+        poll_replies();
+        run_deferred();
+
+        // Only the latest pointer position of the batch is applied
+        if(drag.c)
+            drag_window(0);
+
+        // With a batch deadline, the layout waits for the end of the burst
+        // and only the requests already made are flushed
+        if(BATCH_DELAY && dirty && !batch_due)
+        {
+            if(!batch_armed)
+                arm_timer(TimerBatch, BATCH_DELAY * 1000ULL, 0);
+            batch_armed = 1;
+            xcb_flush(connection);
+        }
+        else
+        {
+            commit();
+            batch_due = 0;
         }
+
+        ++stats.batches;
+        stats.requests += last_seq - seq;
     }
 }
 
-void save_desktop(int i)
+// Go to the next workspace holding windows in that direction, wrapping
+// around. The empty ones are skipped.
+void step_desktop(int dir)
 {
-    desktops[i].master_size = master_size;
-    desktops[i].mode = mode;
-    desktops[i].head = head;
-    desktops[i].current = current;
-}
+    int i, at = desktop_index(current_desktop);
 
-void select_desktop(int i)
-{
-    head = desktops[i].head;
-    current = desktops[i].current;
-    master_size = desktops[i].master_size;
-    mode = desktops[i].mode;
-    current_desktop = i;
+    for(i=1; i<ndesktops; ++i)
+        if(desktops[(at + ndesktops + dir*i) % ndesktops]->nclients)
+        {
+            Arg a = {.i = desktops[(at + ndesktops + dir*i) % ndesktops]->id};
+            change_desktop(a);
+            return;
+        }
 }
 
-void sigchld(int unused)
+// Exchange the positions of two clients of the selected desktop
+void swap(client *a, client *b)
 {
-    // Again, thx to dwm ;)
-    if(signal(SIGCHLD, sigchld) == SIG_ERR)
-        die("Can't install SIGCHLD handler");
-    while(0 < waitpid(-1, NULL, WNOHANG));
+    int tmp = a->pos;
+
+    clients[a->pos = b->pos] = a;
+    clients[b->pos = tmp] = b;
 }
 
-void spawn(const Arg arg)
+void swap_master()
 {
-    if(fork() == 0)
+    if(current != NULL && current->pos != 0 && !layouts[mode].monocle)
     {
-        if(fork() == 0)
-        {
-            if(connection)
-                close(xcb_get_file_descriptor(connection));
+        swap(clients[0], current);
 
-            setsid();
-            execvp((char*)arg.com[0],(char**)arg.com);
-        }
-        exit(0);
+        dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
     }
 }
 
-void start()
+void switch_mode()
 {
-    xcb_generic_event_t *ge = NULL;
+    mode = (mode+1) % nlayouts;
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
 
-    // Main loop, just dispatch events ;)
-    while(!bool_quit)
+// Only the latest position is kept, drag_window() applies it
+void motionnotify(xcb_motion_notify_event_t *e)
+{
+    ++stats.motions;
+
+    if(!drag.c)
+        return;
+
+    drag.rx = e->root_x;
+    drag.ry = e->root_y;
+    drag.moved = 1;
+}
+
+// Only send what differs from the geometry the server already has
+void move_window(client *c, int x, int y, int w, int h)
+{
+    uint32_t values[5];
+    uint16_t mask = 0;
+    int n = 0;
+
+    // An offscreen window gets its position back when shown
+    if(c->x != x && c->hidden != Offscreen)
+    {
+        mask |= XCB_CONFIG_WINDOW_X;
+        values[n++] = x;
+    }
+    c->x = x;
+    if(c->y != y)
+    {
+        mask |= XCB_CONFIG_WINDOW_Y;
+        values[n++] = c->y = y;
+    }
+    if(c->w != w)
+    {
+        mask |= XCB_CONFIG_WINDOW_WIDTH;
+        values[n++] = c->w = w;
+    }
+    if(c->h != h)
     {
-    	xcb_flush(connection);
+        mask |= XCB_CONFIG_WINDOW_HEIGHT;
+        values[n++] = c->h = h;
+    }
+    if(c->bw != BORDER_WIDTH)
+    {
+        mask |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
+        values[n++] = c->bw = BORDER_WIDTH;
+    }
 
-    	if((ge = xcb_wait_for_event(connection)))
-    	{
-	        switch(ge->response_type & ~0x80)
-	        {
-	            case XCB_KEY_PRESS:
-	                keypress((xcb_key_press_event_t*)ge);
-	                break;
+    if(mask)
+        REQ(xcb_configure_window(connection, c->window, mask, values));
+}
 
-	            case XCB_MAP_REQUEST:
-	                puts("maprequest");
-	                maprequest((xcb_map_request_event_t*)ge);
-	                break;
+// The layout computes the geometry, then only what changed is sent
+void tile()
+{
+    const geometry *g = NULL;
+    monitor *m;
+    int i, n;
 
-	            case XCB_DESTROY_NOTIFY:
-	                puts("destroynotify");
-	                destroynotify((xcb_destroy_notify_event_t*)ge);
-	                break;
+    if(get_desktop(current_desktop)->mon < 0)
+        return;
 
-	            case XCB_CONFIGURE_NOTIFY:
-	                puts("configurenotify");
-	                configurenotify((xcb_configure_notify_event_t*)ge);
-	                break;
+    for(i = n = 0; i < nclients; ++i)
+        n += !clients[i]->floating;
 
-	            case XCB_CONFIGURE_REQUEST:
-	                puts("configurerequest");
-	                configurerequest((xcb_configure_request_event_t*)ge);
-	                break;
+    // Nothing to arrange when every window floats, they are still shown
+    // below
+    if(n)
+    {
+        m = &monitors[get_desktop(current_desktop)->mon];
 
-	            default:
-	                break;
-	        }
+        // A new desktop, or a smaller monitor than last time
+        if(!master_size || master_size > m->w-50)
+            master_size = m->w*MASTER_SIZE;
 
-	        free(ge);
-	    }
+        PROFILE(ProfLayout, g = arrange(&get_desktop(current_desktop)->cache, &layouts[mode], n, master_size,
+                                        (geometry){ m->x, m->y, m->w, m->h }));
+        if(!g)
+            die("malloc failed !");
     }
+
+    // Floating windows stay where they are. Monocle: only the current
+    // window stays mapped.
+    for(i = n = 0; i < nclients; ++i)
+        if(clients[i]->floating)
+            show_client(clients[i]);
+        else if(layouts[mode].monocle && clients[i] != current)
+        {
+            hide_client(clients[i], Unmapped);
+            ++n;
+        }
+        else
+        {
+            move_window(clients[i], g[n].x, g[n].y, g[n].w-2*BORDER_WIDTH, g[n].h-2*BORDER_WIDTH);
+            show_client(clients[i]);
+            ++n;
+        }
 }
 
-void swap_master()
+void trace(int level, int type, xcb_window_t w, uint64_t t0)
 {
-    xcb_window_t tmp;
+    struct trace_entry *e = &tracebuf[tracepos++ & (TRACE_SIZE-1)];
 
-    if(head != NULL && current != NULL && current != head && mode == 0)
-    {
-        tmp = head->window;
-        head->window = current->window;
-        current->window = tmp;
-        current = head;
+    e->ns = t0 - start_ns;
+    e->dur_ns = timestamp() - t0;
+    e->window = w;
+    e->type = type;
+    e->level = level;
+}
 
-        tile();
-        update_current();
-    }
+void trace_level_set(const Arg arg)
+{
+    trace_level = arg.i < 0 ? 0 : arg.i;
 }
 
-void switch_mode()
+void toggle_floating()
+{
+    const uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+
+    if(current == NULL)
+        return;
+
+    if((current->floating = !current->floating))
+        REQ(xcb_configure_window(connection, current->window, XCB_CONFIG_WINDOW_STACK_MODE, values));
+
+    dirty |= DIRTY_LAYOUT | DIRTY_FOCUS;
+}
+
+// Lay out the desktop of a monitor other than the selected one
+void tile_monitor(int i)
 {
-    mode = (int)(mode == 0);
-    tile();
-    update_current();
+    int tmp = current_desktop;
+
+    save_desktop(tmp);
+    select_desktop(monitors[i].desktop);
+    PROFILE(ProfTile, tile());
+    save_desktop(current_desktop);
+    select_desktop(tmp);
 }
 
-void move_window(xcb_window_t window, int x, int y, int w, int h)
+uint64_t timestamp()
 {
-    const unsigned int values[4] = {x,y,w,h};
-    xcb_configure_window(connection, window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void tile()
+// Written whole once per batch, after windows left the list
+void update_client_list()
 {
-    client *c;
-    int n = 0;
-    int y = 0;
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetClientList], XCB_ATOM_WINDOW, 32, nnetclients, netclients));
+}
+
+// Only the window losing the focus and the one gaining it need requests
+void update_current()
+{
+    uint32_t values[1] = {XCB_STACK_MODE_ABOVE};
+    monitor *m;
+
+    if(focused == current)
+        return;
 
-    // If only one window
-    if(head && !head->next)
-        move_window(head->window, 0, 0, sw-2, sh-2);
-    else if(head)
+    // In monocle mode, changing the focus swaps the mapped window
+    if(layouts[mode].monocle && current != NULL && !current->floating)
     {
-        switch(mode)
-        {
-	        case 0:
-	            // Master window
-	            move_window(head->window, 0, 0, master_size-2, sh-2);
-
-	            // Stack
-	            for(c = head->next; c; c = c->next)
-	            	++n;
-
-	            for(c = head->next; c; c = c->next)
-	            {
-	                move_window(c->window, master_size, y, sw-master_size-2, (sh/n)-2);
-	                y += sh/n;
-	            }
-	            break;
-
-	        case 1:
-	            for(c = head; c; c = c->next)
-	                move_window(c->window, 0, 0, sw, sh);
-	            break;
-
-	        default:
-	            break;
-        }
+        m = &monitors[selmon];
+        move_window(current, m->x, m->y, m->w-2*BORDER_WIDTH, m->h-2*BORDER_WIDTH);
+        show_client(current);
+
+        if(focused != NULL && focused->desktop == current_desktop && !focused->floating)
+            hide_client(focused, Unmapped);
+    }
+
+    if(focused != NULL)
+        REQ(xcb_change_window_attributes(connection, focused->window, XCB_CW_BORDER_PIXEL, &win_unfocus));
+
+    if(current != NULL)
+    {
+        // Adjust border color
+        REQ(xcb_change_window_attributes(connection, current->window, XCB_CW_BORDER_PIXEL, &win_focus));
+
+        // Give focus
+        REQ(xcb_set_input_focus(connection, XCB_INPUT_FOCUS_PARENT, current->window, XCB_CURRENT_TIME));
+
+        // Place above
+        REQ(xcb_configure_window(connection, current->window, XCB_CONFIG_WINDOW_STACK_MODE, values));
+    }
+    // An empty desktop on another monitor: don't leave the focus behind
+    else if(focused != NULL)
+        REQ(xcb_set_input_focus(connection, XCB_INPUT_FOCUS_POINTER_ROOT, screen->root, XCB_CURRENT_TIME));
+
+    focused = current;
+
+    if(net_active != (current ? current->window : XCB_NONE))
+    {
+        net_active = current ? current->window : XCB_NONE;
+        REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetActiveWindow], XCB_ATOM_WINDOW, 32, 1, &net_active));
     }
 }
 
-void update_current()
+// Pagers see as many desktops as the highest workspace in use needs
+void update_net_desktop()
 {
-    client *c;
-    uint32_t values[1] = {1};
+    uint32_t value = current_desktop;
 
-    for(c = head; c; c = c->next)
+    if(ndesktops && net_ndesktops != desktops[ndesktops-1]->id + 1)
     {
-        if(current == c)
+        net_ndesktops = desktops[ndesktops-1]->id + 1;
+        REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetNumberOfDesktops], XCB_ATOM_CARDINAL, 32, 1, &net_ndesktops));
+    }
+
+    if(net_desktop == current_desktop)
+        return;
+
+    net_desktop = current_desktop;
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetCurrentDesktop], XCB_ATOM_CARDINAL, 32, 1, &value));
+}
+
+// Match the monitors against the active CRTCs. Monitors that kept their
+// geometry are left alone, only new, moved or resized ones relayout.
+void update_monitors(xcb_randr_get_screen_resources_current_cookie_t cookie)
+{
+    xcb_randr_get_screen_resources_current_reply_t *res = NULL;
+    xcb_randr_get_crtc_info_cookie_t cookies[MAXMONITORS];
+    xcb_randr_get_crtc_info_reply_t *info;
+    xcb_randr_crtc_t *crtcs;
+    xcb_randr_mode_info_t *modes;
+    monitor found[MAXMONITORS];
+    desktop *dk;
+    int i, j, d, n = 0, ncrtcs = 0, nmodes;
+    uint64_t t = timestamp();
+
+    if(randr_base >= 0 && (res = xcb_randr_get_screen_resources_current_reply(connection, cookie, NULL)))
+    {
+        crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+        ncrtcs = xcb_randr_get_screen_resources_current_crtcs_length(res);
+        modes = xcb_randr_get_screen_resources_current_modes(res);
+        nmodes = xcb_randr_get_screen_resources_current_modes_length(res);
+        if(ncrtcs > MAXMONITORS)
+            ncrtcs = MAXMONITORS;
+
+        for(i=0; i<ncrtcs; ++i)
+            cookies[i] = xcb_randr_get_crtc_info(connection, crtcs[i], res->config_timestamp);
+
+        for(i=0; i<ncrtcs; ++i)
         {
-            // Adjust border width and border color
-            xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
-            xcb_change_window_attributes(connection, c->window, XCB_CW_BORDER_PIXEL, &win_focus);
+            if(!(info = xcb_randr_get_crtc_info_reply(connection, cookies[i], NULL)))
+                continue;
+
+            // Skip disabled CRTCs and clones
+            for(j=0; j<n; ++j)
+                if(found[j].x == info->x && found[j].y == info->y)
+                    break;
+
+            if(info->mode && info->num_outputs && j == n)
+            {
+                found[n] = (monitor){ .crtc = crtcs[i], .x = info->x, .y = info->y, .w = info->width, .h = info->height };
 
-            // Give focus
-            xcb_set_input_focus(connection, XCB_INPUT_FOCUS_PARENT, c->window, XCB_CURRENT_TIME);
+                for(j=0; j<nmodes; ++j)
+                    if(modes[j].id == info->mode && modes[j].htotal && modes[j].vtotal)
+                        found[n].refresh = modes[j].dot_clock / ((uint32_t)modes[j].htotal * modes[j].vtotal);
+                ++n;
+            }
 
-            // Place above
-            values[0] = XCB_STACK_MODE_ABOVE;
-            xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
+            free(info);
         }
 
-        else
+        free(res);
+    }
+
+    // No RandR, or nothing lit: the whole root window
+    if(!n)
+        found[n++] = (monitor){ .crtc = 0, .x = 0, .y = 0, .w = sw, .h = sh };
+
+    save_desktop(current_desktop);
+
+    // Monitors that went away hide their desktop
+    for(i=0; i<nmonitors; )
+    {
+        for(j=0; j<n && found[j].crtc != monitors[i].crtc; ++j);
+
+        if(j < n)
+        {
+            ++i;
+            continue;
+        }
+
+        dk = get_desktop(monitors[i].desktop);
+        for(j=0; j<dk->nclients; ++j)
+            hide_client(dk->clients[j], DESKTOP_HIDE);
+        dk->mon = -1;
+
+        for(j=i+1; j<nmonitors; ++j)
         {
-            xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
-            xcb_change_window_attributes(connection, c->window, XCB_CW_BORDER_PIXEL, &win_unfocus);
+            monitors[j-1] = monitors[j];
+            get_desktop(monitors[j-1].desktop)->mon = j-1;
         }
+        --nmonitors;
+
+        if(selmon > i || selmon == nmonitors)
+            --selmon;
     }
 
-    xcb_flush(connection);
+    // New monitors show the first hidden desktop, the others only relayout
+    // when their geometry changed
+    for(i=0; i<n; ++i)
+    {
+        for(j=0; j<nmonitors && monitors[j].crtc != found[i].crtc; ++j);
+
+        if(j == nmonitors)
+        {
+            if(nmonitors == MAXMONITORS)
+                break;
+
+            for(d=1; (dk = find_desktop(d)) && dk->mon >= 0; ++d);
+
+            found[i].desktop = d;
+            found[i].dirty = 1;
+            get_desktop(d)->mon = nmonitors;
+            monitors[nmonitors++] = found[i];
+            continue;
+        }
+
+        monitors[j].refresh = found[i].refresh;
+        if(monitors[j].x != found[i].x || monitors[j].y != found[i].y || monitors[j].w != found[i].w || monitors[j].h != found[i].h)
+        {
+            monitors[j].x = found[i].x;
+            monitors[j].y = found[i].y;
+            monitors[j].w = found[i].w;
+            monitors[j].h = found[i].h;
+            monitors[j].dirty = 1;
+        }
+    }
+
+    if(selmon < 0)
+        selmon = 0;
+
+    // The selected monitor may be another one now
+    if(monitors[selmon].desktop != current_desktop)
+        dirty |= DIRTY_FOCUS;
+    select_desktop(monitors[selmon].desktop);
+
+    // The desktops of the monitors that went away may be empty
+    for(i=ndesktops-1; i>=0; --i)
+        release_desktop(desktops[i]->id);
+
+    TRACE(TRACE_INFO, TraceMonitors, XCB_NONE, t);
+}
+
+void wait_reply(unsigned int sequence, xcb_window_t w, void (*handler)(xcb_window_t w, void *reply))
+{
+    if(nwaits == waits_size)
+    {
+        waits_size = waits_size ? 2*waits_size : 32;
+        if(!(waits = realloc(waits, waits_size*sizeof(*waits))))
+            die("realloc failed !");
+    }
+
+    waits[nwaits++] = (struct reply_wait){ sequence, w, handler };
+}
+
+void watch(int fd, uint32_t id)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        die("can't watch fd %d", fd);
+}
+
+void update_numlockmask(xcb_get_modifier_mapping_cookie_t cookie)
+{
+    int i, j;
+    xcb_get_modifier_mapping_reply_t *reply;
+    xcb_keycode_t *modmap, *numlock, *code;
+
+    numlockmask = 0;
+
+    if(!(reply = xcb_get_modifier_mapping_reply(connection, cookie, NULL)))
+        return;
+
+    if((numlock = xcb_key_symbols_get_keycode(keysyms, XK_Num_Lock)))
+    {
+        modmap = xcb_get_modifier_mapping_keycodes(reply);
+
+        for(i=0; i<8; ++i)
+            for(j=0; j<reply->keycodes_per_modifier; ++j)
+                for(code = numlock; *code != XCB_NO_SYMBOL; ++code)
+                    if(modmap[i*reply->keycodes_per_modifier + j] == *code)
+                        numlockmask = 1 << i;
+
+        free(numlock);
+    }
+
+    free(reply);
+}
+
+client *wintoclient(xcb_window_t w)
+{
+    client *c;
+
+    for(c = wintable[winhash(w)]; c; c = c->hnext)
+        if(c->window == w)
+            return c;
+
+    return NULL;
 }
 
 // Grab events on the root window. If we can't, then another WM is already listening !
-static void register_events(void)
+static xcb_void_cookie_t register_events(void)
 {
-    unsigned int values[1] = {XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_BUTTON_PRESS};
-    xcb_generic_error_t *error = xcb_request_check(connection, xcb_change_window_attributes_checked(connection, screen->root, XCB_CW_EVENT_MASK, values));
-    
-    xcb_flush(connection);
+    unsigned int values[1] = {XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_BUTTON_PRESS};
 
-    if(error)
-    	die("another WM is already running !");
+    return xcb_change_window_attributes_checked(connection, screen->root, XCB_CW_EVENT_MASK, values);
+}
+
+// A WM_PROTOCOLS message. Pongs name the window they answer for, the
+// ping carries it too.
+void send_protocol(xcb_window_t w, xcb_atom_t protocol)
+{
+    xcb_client_message_event_t ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.response_type = XCB_CLIENT_MESSAGE;
+    ev.format = 32;
+    ev.window = w;
+    ev.type = wmatom[WMProtocols];
+    ev.data.data32[0] = protocol;
+    ev.data.data32[1] = XCB_CURRENT_TIME;
+    ev.data.data32[2] = w;
+    REQ(xcb_send_event(connection, 0, w, XCB_EVENT_MASK_NO_EVENT, (const char*)&ev));
+}
 
-    free(error);
+void set_wm_state(client *c, uint32_t state)
+{
+    const uint32_t data[] = {state, XCB_NONE};
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, c->window, wmatom[WMState], wmatom[WMState], 32, 2, data));
 }
 
 void setup()
 {
     int i;
-
-    // Install a signal
-    sigchld(0);
+    sigset_t mask;
+    xcb_void_cookie_t redirect;
+    xcb_alloc_color_cookie_t focus_cookie, unfocus_cookie;
+    xcb_intern_atom_cookie_t atom_cookies[WMLast];
+    xcb_get_modifier_mapping_cookie_t modmap_cookie;
+    xcb_randr_get_screen_resources_current_cookie_t monitors_cookie = {0};
+    xcb_query_tree_cookie_t tree_cookie;
+    const xcb_query_extension_reply_t *randr;
+    xcb_generic_error_t *error;
+
+    // Children, statistics requests and termination are handled from the
+    // main loop
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        die("can't create signalfd");
+    setup_trace();
 
     xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(connection));
 
@@ -742,62 +3086,245 @@ void setup()
 
     screen = iter.data;
 
-    register_events();
+    // Don't leak the connection to the programs we spawn
+    fcntl(xcb_get_file_descriptor(connection), F_SETFD, FD_CLOEXEC);
 
-    // Screen width and height
+    // Send every request we need an answer to before waiting for any of
+    // them, startup then costs a single round trip
+    redirect = register_events();
+    xcb_prefetch_extension_data(connection, &xcb_randr_id);
+    focus_cookie = alloc_color(FOCUS);
+    unfocus_cookie = alloc_color(UNFOCUS);
+    for(i=0; i < WMLast; ++i)
+        atom_cookies[i] = xcb_intern_atom(connection, 0, strlen(wmatomnames[i]), wmatomnames[i]);
+
+    modmap_cookie = xcb_get_modifier_mapping(connection);
+    tree_cookie = xcb_query_tree(connection, screen->root);
+
+    // Asks for the keyboard mapping without waiting for it
+    if(!(keysyms = xcb_key_symbols_alloc(connection)))
+        die("couldn't allocate keysyms !");
+
+    // Screen width and height, and the outputs within if RandR is there.
+    // Knowing about the extension is the only answer we wait for here.
     sw = screen->width_in_pixels;
     sh = screen->height_in_pixels;
+    if((randr = xcb_get_extension_data(connection, &xcb_randr_id)) && randr->present)
+    {
+        randr_base = randr->first_event;
+        xcb_discard_reply(connection, xcb_randr_query_version(connection, 1, 3).sequence);
+        xcb_randr_select_input(connection, screen->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+        monitors_cookie = xcb_randr_get_screen_resources_current(connection, screen->root);
+    }
+
+    // Now collect the replies
+    if((error = xcb_request_check(connection, redirect)))
+    	die("another WM is already running !");
 
     // Colors
-    win_focus = get_color(FOCUS);
-    win_unfocus = get_color(UNFOCUS);
+    win_focus = get_color(focus_cookie, FOCUS);
+    win_unfocus = get_color(unfocus_cookie, UNFOCUS);
 
-    if(!(keysyms = xcb_key_symbols_alloc(connection)))
-        die("couldn't allocate keysyms !");
+    // Atoms
+    for(i=0; i < WMLast; ++i)
+        wmatom[i] = get_intern_atom(atom_cookies[i], wmatomnames[i]);
+    properties[PropProtocols].atom = wmatom[WMProtocols];
 
     // Shortcuts
+    update_numlockmask(modmap_cookie);
     grabkeys();
 
+    setup_control();
+
+    if(SPAWN_HELPER)
+        start_helper();
+
     // Vertical stack
     mode = 0;
 
     bool_quit = 0;
 
-    head = current = NULL;
+    clients = NULL;
+    nclients = clients_size = 0;
+    current = focused = NULL;
+
+    // Master size, set by the first layout from the monitor width
+    master_size = 0;
+
+    // Monitors show desktops 1, 2... the first one is selected, the others
+    // come when asked for
+    current_desktop = 1;
+    update_monitors(monitors_cookie);
+
+    setup_ewmh();
+
+    // Back from a restart: the desktops as we left them
+    restore_state();
+
+    // Other windows mapped before we came go to the first desktop
+    scan(tree_cookie);
+}
+
+// Commands come as datagrams on $XDG_RUNTIME_DIR/catwm-xcb$DISPLAY, whose
+// path is exported as CATWM_SOCKET to the programs we spawn
+void setup_control()
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    const char *display = getenv("DISPLAY");
+    mode_t mask;
+    int ret;
+
+    ctladdr.sun_family = AF_UNIX;
+    if(dir)
+        snprintf(ctladdr.sun_path, sizeof(ctladdr.sun_path), "%s/catwm-xcb%s", dir, display ? display : "");
+    else
+        snprintf(ctladdr.sun_path, sizeof(ctladdr.sun_path), "/tmp/catwm-xcb-%d%s", (int)getuid(), display ? display : "");
+
+    if((ctlfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        fprintf(stderr, "catwm-xcb: no control socket\n");
+        return;
+    }
+
+    // Only ours from the moment it exists, /tmp is open to everyone
+    unlink(ctladdr.sun_path);
+    mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+    ret = bind(ctlfd, (struct sockaddr*)&ctladdr, sizeof(ctladdr));
+    umask(mask);
+    if(ret < 0)
+    {
+        fprintf(stderr, "catwm-xcb: cannot bind control socket %s\n", ctladdr.sun_path);
+        close(ctlfd);
+        ctlfd = -1;
+        return;
+    }
+
+    setenv("CATWM_SOCKET", ctladdr.sun_path, 1);
+}
+
+// Tell pagers and bars what we support, through a child window of ours, and
+// start from empty root properties
+void setup_ewmh()
+{
+    xcb_window_t check = xcb_generate_id(connection);
+
+    REQ(xcb_create_window(connection, XCB_COPY_FROM_PARENT, check, screen->root, -1, -1, 1, 1, 0,
+                          XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, NULL));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, check, wmatom[NetSupportingWMCheck], XCB_ATOM_WINDOW, 32, 1, &check));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, check, wmatom[NetWMName], wmatom[UTF8String], 8, strlen("catwm-xcb"), "catwm-xcb"));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetSupportingWMCheck], XCB_ATOM_WINDOW, 32, 1, &check));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetSupported], XCB_ATOM_ATOM, 32, WMLast-NetSupported, &wmatom[NetSupported]));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetClientList], XCB_ATOM_WINDOW, 32, 0, NULL));
+    REQ(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, screen->root, wmatom[NetActiveWindow], XCB_ATOM_WINDOW, 32, 1, &net_active));
+}
+
+void setup_loop()
+{
+    int i;
+
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        die("can't create epoll instance");
+
+    watch(xcb_get_file_descriptor(connection), WatchX);
+    if(ctlfd >= 0)
+        watch(ctlfd, WatchControl);
+    watch(sigfd, WatchSignal);
+
+    for(i=0; i<TimerLast; ++i)
+    {
+        if((timerfd[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+            die("can't create timerfd");
+        watch(timerfd[i], WatchTimer + i);
+    }
+
+    if(STATS_INTERVAL)
+        arm_timer(TimerStats, STATS_INTERVAL * 1000000000ULL, STATS_INTERVAL * 1000000000ULL);
+}
+
+void setup_trace()
+{
+    struct sigaction sa;
+    stack_t ss;
+    const int sigs[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    int i;
+
+    if(!TRACE_LEVEL)
+        return;
+
+    // Own stack, the crash may come from running out of it
+    ss.ss_sp = malloc(SIGSTKSZ);
+    ss.ss_size = SIGSTKSZ;
+    ss.ss_flags = 0;
+    if(ss.ss_sp)
+        sigaltstack(&ss, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = crash;
+    sa.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for(i=0; i<TABLENGTH(sigs); ++i)
+        sigaction(sigs[i], &sa, NULL);
+}
 
-    // Master size
-    master_size = sw*MASTER_SIZE;
+void show_client(client *c)
+{
+    const uint32_t values[] = {c->x};
 
-    // Set up all desktop
-    for(i=0; i < TABLENGTH(desktops); ++i)
+    if(c->hidden == Unmapped)
     {
-        desktops[i].master_size = master_size;
-        desktops[i].mode = mode;
-        desktops[i].head = head;
-        desktops[i].current = current;
+        REQ(xcb_map_window(connection, c->window));
+        set_wm_state(c, XCB_ICCCM_WM_STATE_NORMAL);
     }
+    else if(c->hidden == Offscreen)
+        REQ(xcb_configure_window(connection, c->window, XCB_CONFIG_WINDOW_X, values));
 
-    // Select first desktop by default
-    const Arg arg = {.i = 1};
-    current_desktop = arg.i;
-    change_desktop(arg);
+    c->hidden = Shown;
 }
 
 int main(int argc, char **argv)
 {
+    char buf[16];
+    int fd = -1;
+
+    start_ns = timestamp();
+
     // Connect to the X server through XCB
-    if(!(connection = xcb_connect(NULL, &screenNum)))
+    connection = xcb_connect(NULL, &screenNum);
+    if(xcb_connection_has_error(connection))
         die("Cannot open display!");
 
     // Setup env
     setup();
+    stats.setup_ns = timestamp() - start_ns;
 
     // Start WM
     start();
 
+    if(bool_restart)
+        fd = save_state();
+
+    if(ctlfd >= 0)
+    {
+        close(ctlfd);
+        unlink(ctladdr.sun_path);
+    }
+
     // Disconnect
     xcb_disconnect(connection);
 
+    // Same pid, same children: the new instance picks the state up from
+    // the fd named in CATWM_STATE
+    if(bool_restart)
+    {
+        if(fd >= 0)
+        {
+            snprintf(buf, sizeof(buf), "%d", fd);
+            setenv("CATWM_STATE", buf, 1);
+        }
+        execvp(argv[0], argv);
+        die("cannot restart %s", argv[0]);
+    }
+
     return 0;
 }
 
@@ -36,6 +36,43 @@
 // Mod (Mod1 == alt) and master size
 #define MOD             XCB_MOD_MASK_1
 #define MASTER_SIZE     0.6
+#define BORDER_WIDTH    1
+
+// Desktops are created on demand, the control socket reaches ids up to
+// MAX_DESKTOPS-1
+#define MAX_DESKTOPS    1024
+
+// Desktop switching: commit under a server grab, hide windows by moving
+// them offscreen instead of unmapping them, wait for the server to be done
+// before measuring the switch time
+#define GRAB_ON_SWITCH  1
+#define HIDE_OFFSCREEN  0
+#define SWITCH_SYNC     0
+
+// Spawn programs through a small helper process forked at startup
+#define SPAWN_HELPER    0
+
+// Main loop timers: relayout at most once per BATCH_DELAY microseconds
+// during bursts (0 relayouts after every batch), dump the statistics every
+// STATS_INTERVAL seconds (0 only on SIGUSR1)
+#define BATCH_DELAY     0
+#define STATS_INTERVAL  0
+
+// Pointer: MOD+MOVE_BUTTON moves a window, MOD+RESIZE_BUTTON resizes it,
+// both make it float. Drags configure the window at most once per frame,
+// DRAG_RATE times a second when RandR doesn't tell the refresh rate.
+#define MOVE_BUTTON     XCB_BUTTON_INDEX_1
+#define RESIZE_BUTTON   XCB_BUTTON_INDEX_3
+#define MIN_SIZE        32
+#define DRAG_RATE       60
+
+// Milliseconds a window asked to close has to answer _NET_WM_PING before
+// being killed
+#define KILL_TIMEOUT    2000
+
+// Trace ring levels compiled in: 0 none, 1 WM actions, 2 every X event as
+// well. The 't N' control command lowers it at runtime, SIGUSR2 dumps it.
+#define TRACE_LEVEL     2
 
 // Colors
 #define FOCUS           "#D64937"
@@ -43,7 +80,6 @@
 
 const char* dmenucmd[] = {"dmenu_run",NULL};
 const char* urxvtcmd[] = {"urxvt",NULL};
-const char* killit[] =   {"pkill", "catwm-xcb", NULL};
 const char* lockcmd[]  = {"slock",NULL};
 const char* next[]     = {"ncmpcpp","next",NULL};
 const char* prev[]     = {"ncmpcpp","prev",NULL};
@@ -64,7 +100,7 @@ static struct key keys[] = {
     {  MOD,             XK_x,                       kill_client,    {NULL}},
     {  MOD,             XK_j,                       prev_win,       {NULL}},
     {  MOD,             XK_Tab,                     next_win,       {NULL}},
-    {  MOD,             XK_k,                       spawn,          {.com = killit}},
+    {  MOD,             XK_k,                       quit,           {NULL}},
     {  MOD|ShiftMask,   XK_j,                       move_up,        {NULL}},
     {  MOD|ShiftMask,   XK_k,                       move_down,      {NULL}},
     {  MOD,             XK_Return,                  swap_master,    {NULL}},
@@ -79,6 +115,8 @@ static struct key keys[] = {
     {  MOD,             XK_u,                       spawn,          {.com = urxvtcmd}},
     {  MOD,             XK_Right,                   next_desktop,   {NULL}},
     {  MOD,             XK_Left,                    prev_desktop,   {NULL}},
+    {  MOD,             XK_o,                       next_monitor,   {NULL}},
+    {  MOD,             XK_f,                       toggle_floating,{NULL}},
        DESKTOPCHANGE(   XK_0,                                       0)
        DESKTOPCHANGE(   XK_1,                                       1)
        DESKTOPCHANGE(   XK_2,                                       2)
@@ -89,6 +127,7 @@ static struct key keys[] = {
        DESKTOPCHANGE(   XK_7,                                       7)
        DESKTOPCHANGE(   XK_8,                                       8)
        DESKTOPCHANGE(   XK_9,                                       9)
+    {  MOD|ShiftMask,   XK_r,                       restart,        {NULL}},
     {  MOD,             XK_q,                       quit,           {NULL}}
 };
 
@@ -0,0 +1,163 @@
+/*
+ *  layout.c: layouts of catwm-xcb, computed without talking to the X server
+ *
+ *  See catwm-xcb.c for copyright and licence.
+ */
+
+#include <stdlib.h>
+
+#include "layout.h"
+
+// Switching mode goes through them in this order
+const layout layouts[] = {
+    { "tile",       layout_tile,    0 },
+    { "monocle",    layout_monocle, 1 },
+    { "bstack",     layout_bstack,  0 },
+    { "grid",       layout_grid,    0 },
+    { "spiral",     layout_spiral,  0 },
+};
+const int nlayouts = sizeof(layouts)/sizeof(layouts[0]);
+
+// Master on the left, the others stacked on the right
+void layout_tile(int n, int master_size, geometry area, geometry *g)
+{
+    int i, y = area.y;
+
+    if(n == 1)
+    {
+        g[0] = area;
+        return;
+    }
+
+    g[0] = (geometry){ area.x, area.y, master_size, area.h };
+
+    for(i = 1; i < n; ++i)
+    {
+        g[i] = (geometry){ area.x+master_size, y, area.w-master_size, area.h/(n-1) };
+        y += area.h/(n-1);
+    }
+}
+
+void layout_monocle(int n, int master_size, geometry area, geometry *g)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+        g[i] = area;
+}
+
+// Master on top, the others side by side below. The master takes as much of
+// the height as it would take of the width in tile.
+void layout_bstack(int n, int master_size, geometry area, geometry *g)
+{
+    int i, x = area.x;
+    int mh = area.w ? (long)master_size*area.h/area.w : 0;
+
+    if(n == 1)
+    {
+        g[0] = area;
+        return;
+    }
+
+    g[0] = (geometry){ area.x, area.y, area.w, mh };
+
+    for(i = 1; i < n; ++i)
+    {
+        g[i] = (geometry){ x, area.y+mh, area.w/(n-1), area.h-mh };
+        x += area.w/(n-1);
+    }
+}
+
+// As many columns as rows, the last columns taking one window more when the
+// count is not a square
+void layout_grid(int n, int master_size, geometry area, geometry *g)
+{
+    int i, c, r, cols, rows, x, y;
+
+    for(cols = 1; cols*cols < n; ++cols);
+
+    for(i = c = 0; c < cols; ++c)
+    {
+        rows = n/cols + (c >= cols - n%cols);
+        x = area.x + c*area.w/cols;
+
+        for(r = 0; r < rows; ++r, ++i)
+        {
+            y = area.y + r*area.h/rows;
+            g[i] = (geometry){ x, y, area.x + (c+1)*area.w/cols - x, area.y + (r+1)*area.h/rows - y };
+        }
+    }
+}
+
+// Each window takes half of what is left, turning clockwise: left, top,
+// right, bottom. The master takes master_size.
+void layout_spiral(int n, int master_size, geometry area, geometry *g)
+{
+    int i, half;
+
+    for(i = 0; i < n; ++i)
+    {
+        g[i] = area;
+
+        // The last one, or no room left to split: the rest share the area
+        if(i == n-1 || area.w < 2 || area.h < 2)
+            continue;
+
+        switch(i % 4)
+        {
+            case 0:
+                half = i ? area.w/2 : master_size;
+                g[i].w = half;
+                area.x += half;
+                area.w -= half;
+                break;
+
+            case 1:
+                g[i].h = area.h/2;
+                area.y += g[i].h;
+                area.h -= g[i].h;
+                break;
+
+            case 2:
+                area.w -= area.w/2;
+                g[i].x += area.w;
+                g[i].w -= area.w;
+                break;
+
+            case 3:
+                area.h -= area.h/2;
+                g[i].y += area.h;
+                g[i].h -= area.h;
+                break;
+        }
+    }
+}
+
+const geometry *arrange(layout_cache *cache, const layout *l, int n, int master_size, geometry area)
+{
+    if(cache->g && cache->l == l && cache->n == n && cache->master_size == master_size &&
+       cache->area.x == area.x && cache->area.y == area.y && cache->area.w == area.w && cache->area.h == area.h)
+    {
+        ++cache->hits;
+        return cache->g;
+    }
+
+    if(n > cache->size || !cache->g)
+    {
+        cache->size = n > 8 ? n : 8;
+        free(cache->g);
+        cache->l = NULL;
+        if(!(cache->g = malloc(cache->size*sizeof(geometry))))
+            return NULL;
+    }
+
+    ++cache->misses;
+    cache->l = l;
+    cache->n = n;
+    cache->master_size = master_size;
+    cache->area = area;
+    if(n)
+        l->arrange(n, master_size, area, cache->g);
+
+    return cache->g;
+}
@@ -0,0 +1,58 @@
+/*
+ *  layout.h: layouts of catwm-xcb, computed without talking to the X server
+ *
+ *  See catwm-xcb.c for copyright and licence.
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+typedef struct geometry geometry;
+struct geometry
+{
+    int x, y, w, h;
+};
+
+// Fill g[0..n-1] with the outer geometry of n windows in the given area, the
+// first one being the master. master_size is the width of the master area.
+typedef void (*arrange_func)(int n, int master_size, geometry area, geometry *g);
+
+typedef struct layout layout;
+struct layout
+{
+    const char *name;
+    arrange_func arrange;
+
+    // Only the current window is shown, over the whole area
+    int monocle;
+};
+
+// Last result of a layout, reused as long as the inputs stay the same
+typedef struct layout_cache layout_cache;
+struct layout_cache
+{
+    const layout *l;
+    int n;
+    int master_size;
+    geometry area;
+
+    geometry *g;
+    int size;
+
+    unsigned long hits;
+    unsigned long misses;
+};
+
+void layout_tile(int n, int master_size, geometry area, geometry *g);
+void layout_monocle(int n, int master_size, geometry area, geometry *g);
+void layout_bstack(int n, int master_size, geometry area, geometry *g);
+void layout_grid(int n, int master_size, geometry area, geometry *g);
+void layout_spiral(int n, int master_size, geometry area, geometry *g);
+
+// Geometry of n windows for this layout, NULL if we ran out of memory
+const geometry *arrange(layout_cache *cache, const layout *l, int n, int master_size, geometry area);
+
+extern const layout layouts[];
+extern const int nlayouts;
+
+#endif